@@ -1,12 +1,199 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <sys/socket.h>
 #include <net/route.h>
 #include <netlink/netlink.h>
 #include <netlink/netlink_snl.h>
 #include <netlink/netlink_snl_route_parsers.h>
+#include <netlink/netlink_route.h>
 
 #define THROW_ON_ERRNO(_v) if (_v) { PyErr_SetFromErrno(PyExc_OSError); return NULL; }
 
+/*
+ * relevance filter for incoming messages, messages that fail it are dropped
+ * before any python object is created for them.  links always pass, addrs pass
+ * on interesting ifs/families, routes pass if in the table and either a default
+ * or out an interesting if and overlapping one of the prefixes, neighbors pass
+ * on interesting ifs if they overlap one of the prefixes.
+ * mirrored by nl_filter in bsdnet.py
+ */
+#define NL_FILTER_MAX_IFS 64
+#define NL_FILTER_MAX_PREFIXES 64
+#define NL_FILTER_AF_INET 0x1
+#define NL_FILTER_AF_INET6 0x2
+/*
+ * a filtered event read gives up after skipping this many messages and returns
+ * NULL with errno 0, so the caller picks up a filter replaced in the meantime.
+ * steady traffic that never passes would otherwise keep the read, and the
+ * filter it was called with, in here forever (the socket timeout never fires)
+ */
+#define NL_FILTER_MAX_SKIP 256
+
+struct nl_filter_prefix {
+    uint8_t family;
+    uint8_t len;
+    uint8_t addr[16];
+};
+
+struct nl_filter {
+    uint32_t enabled;
+    uint32_t table;
+    uint32_t af_mask;
+    uint32_t num_ifs;
+    uint32_t ifs[NL_FILTER_MAX_IFS];
+    uint32_t num_prefixes;
+    struct nl_filter_prefix prefixes[NL_FILTER_MAX_PREFIXES];
+};
+
+static bool nl_filter_af(const struct nl_filter *f, int family) {
+    if (family == AF_INET) {
+        return f->af_mask & NL_FILTER_AF_INET;
+    } else if (family == AF_INET6) {
+        return f->af_mask & NL_FILTER_AF_INET6;
+    }
+    return false;
+}
+
+static bool nl_filter_if(const struct nl_filter *f, uint32_t ifindex) {
+    for (uint32_t i = 0; i < f->num_ifs; i++) {
+        if (f->ifs[i] == ifindex) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* do the two prefixes overlap, ie. does the shorter contain the longer */
+static bool nl_filter_overlaps(const struct nl_filter_prefix *p, int family, const uint8_t *addr, int len) {
+    if (p->family != family) {
+        return false;
+    }
+    int n = len < p->len ? len : p->len;
+    int bytes = n / 8;
+    int bits = n % 8;
+    if (memcmp(p->addr, addr, bytes)) {
+        return false;
+    }
+    if (bits) {
+        uint8_t mask = 0xff << (8 - bits);
+        if ((p->addr[bytes] ^ addr[bytes]) & mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool nl_filter_match_route(const struct nl_filter *f, struct nlmsghdr *hdr) {
+    struct rtmsg *rtm = (struct rtmsg *)NLMSG_DATA(hdr);
+    uint32_t table = rtm->rtm_table;
+    uint32_t oif = 0;
+    const uint8_t *dst = NULL;
+    int dst_size = 0;
+
+    int off = NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(struct rtmsg));
+    while (off + (int)sizeof(struct nlattr) <= (int)hdr->nlmsg_len) {
+        struct nlattr *nla = (struct nlattr *)((char *)hdr + off);
+        if (nla->nla_len < sizeof(struct nlattr) || off + nla->nla_len > hdr->nlmsg_len) {
+            break;
+        }
+        void *data = (char *)nla + NLA_HDRLEN;
+        int data_len = nla->nla_len - NLA_HDRLEN;
+        if (nla->nla_type == RTA_TABLE && data_len == sizeof(uint32_t)) {
+            memcpy(&table, data, sizeof(uint32_t));
+        } else if (nla->nla_type == RTA_OIF && data_len == sizeof(uint32_t)) {
+            memcpy(&oif, data, sizeof(uint32_t));
+        } else if (nla->nla_type == RTA_DST) {
+            dst = data;
+            dst_size = data_len;
+        }
+        off += NLA_ALIGN(nla->nla_len);
+    }
+
+    if (table != f->table) {
+        return false;
+    }
+    /* defaults are what we manage, they always pass */
+    if (rtm->rtm_dst_len == 0) {
+        return true;
+    }
+    if (!nl_filter_af(f, rtm->rtm_family) || !nl_filter_if(f, oif)) {
+        return false;
+    }
+    if (dst == NULL || dst_size * 8 < rtm->rtm_dst_len) {
+        return false;
+    }
+    for (uint32_t i = 0; i < f->num_prefixes; i++) {
+        if (nl_filter_overlaps(&f->prefixes[i], rtm->rtm_family, dst, rtm->rtm_dst_len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool nl_filter_match_neigh(const struct nl_filter *f, struct nlmsghdr *hdr) {
+    struct ndmsg *ndm = (struct ndmsg *)NLMSG_DATA(hdr);
+    uint32_t ifindex = ndm->ndm_ifindex;
+    const uint8_t *dst = NULL;
+    int dst_size = 0;
+
+    int off = NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(struct ndmsg));
+    while (off + (int)sizeof(struct nlattr) <= (int)hdr->nlmsg_len) {
+        struct nlattr *nla = (struct nlattr *)((char *)hdr + off);
+        if (nla->nla_len < sizeof(struct nlattr) || off + nla->nla_len > hdr->nlmsg_len) {
+            break;
+        }
+        void *data = (char *)nla + NLA_HDRLEN;
+        int data_len = nla->nla_len - NLA_HDRLEN;
+        if (nla->nla_type == NDA_IFINDEX && data_len == sizeof(uint32_t)) {
+            memcpy(&ifindex, data, sizeof(uint32_t));
+        } else if (nla->nla_type == NDA_DST) {
+            dst = data;
+            dst_size = data_len;
+        }
+        off += NLA_ALIGN(nla->nla_len);
+    }
+
+    if (!nl_filter_af(f, ndm->ndm_family) || !nl_filter_if(f, ifindex) || dst == NULL) {
+        return false;
+    }
+    for (uint32_t i = 0; i < f->num_prefixes; i++) {
+        if (nl_filter_overlaps(&f->prefixes[i], ndm->ndm_family, dst, dst_size * 8)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool nl_filter_match(const struct nl_filter *f, struct nlmsghdr *hdr) {
+    if (f == NULL || !f->enabled) {
+        return true;
+    }
+    switch (hdr->nlmsg_type) {
+    case RTM_NEWROUTE:
+    case RTM_DELROUTE:
+        if (hdr->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg))) {
+            return true;
+        }
+        return nl_filter_match_route(f, hdr);
+    case RTM_NEWADDR:
+    case RTM_DELADDR: {
+        if (hdr->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg))) {
+            return true;
+        }
+        struct ifaddrmsg *ifa = (struct ifaddrmsg *)NLMSG_DATA(hdr);
+        return nl_filter_af(f, ifa->ifa_family) && nl_filter_if(f, ifa->ifa_index);
+    }
+    case RTM_NEWNEIGH:
+    case RTM_DELNEIGH:
+        if (hdr->nlmsg_len < NLMSG_LENGTH(sizeof(struct ndmsg))) {
+            return true;
+        }
+        return nl_filter_match_neigh(f, hdr);
+    default:
+        return true;
+    }
+}
+
 static PyObject* bsdnet_snl_init(PyObject* self, PyObject* args) {
     struct snl_state* ss;
     int netlink_family;
@@ -144,6 +331,59 @@ static PyObject *bsdnet_snl_read_message(PyObject *self, PyObject *args) {
     return PyLong_FromVoidPtr(hdr); 
 }
 
+/* as snl_read_message, but skips messages that fail the filter, see NL_FILTER_MAX_SKIP */
+static PyObject *bsdnet_snl_read_message_filtered(PyObject *self, PyObject *args) {
+    struct snl_state *ss;
+    struct nl_filter *f;
+    if (!PyArg_ParseTuple(args, "LL", &ss, &f)) {
+        return NULL;
+    }
+    struct nlmsghdr *hdr;
+    int my_errno;
+    Py_BEGIN_ALLOW_THREADS;
+    for (int skipped = 0;; skipped++) {
+        if (skipped == NL_FILTER_MAX_SKIP) {
+            hdr = NULL;
+            my_errno = 0;
+            break;
+        }
+        errno = 0;
+        hdr = snl_read_message(ss);
+        my_errno = errno;
+        if (hdr == NULL || nl_filter_match(f, hdr)) {
+            break;
+        }
+    }
+    Py_END_ALLOW_THREADS;
+    THROW_ON_ERRNO(my_errno);
+    return PyLong_FromVoidPtr(hdr);
+}
+
+/*
+ * as snl_read_reply_multi, but skips messages that fail the filter
+ * a dump is finite and is read with the filter it was started for, no skip cap
+ */
+static PyObject *bsdnet_snl_read_reply_multi_filtered(PyObject *self, PyObject *args) {
+    struct snl_state *ss;
+    uint32_t nlmsg_seq;
+    struct snl_errmsg_data *e;
+    struct nl_filter *f;
+    if (!PyArg_ParseTuple(args, "LiLL", &ss, &nlmsg_seq, &e, &f)) {
+        return NULL;
+    }
+    struct nlmsghdr *hdr;
+    int my_errno;
+    Py_BEGIN_ALLOW_THREADS;
+    do {
+        errno = 0;
+        hdr = snl_read_reply_multi(ss, nlmsg_seq, e);
+        my_errno = errno;
+    } while (hdr != NULL && !nl_filter_match(f, hdr));
+    Py_END_ALLOW_THREADS;
+    THROW_ON_ERRNO(my_errno);
+    return PyLong_FromVoidPtr(hdr);
+}
+
 static PyObject* bsdnet_snl_init_writer(PyObject* self, PyObject* args) {
     struct snl_state* ss;
     struct snl_writer* nw;
@@ -206,6 +446,118 @@ static PyObject *bsdnet_snl_finalize_msg(PyObject *self, PyObject *args) {
     return PyLong_FromVoidPtr(hdr);
 }
 
+/*
+ * snl_rtm_link_parser_simple plus operational state, see Link in bsdnetlink.py
+ * mirrored by bsdnet_parsed_link in bsdnet.py
+ */
+struct bsdnet_parsed_link {
+    uint32_t ifi_index;
+    uint32_t ifla_mtu;
+    uint16_t ifi_type;
+    uint32_t ifi_flags;
+    uint8_t ifla_operstate;
+    char *ifla_ifname;
+};
+
+#define _IN(_field) offsetof(struct ifinfomsg, _field)
+#define _OUT(_field) offsetof(struct bsdnet_parsed_link, _field)
+static struct snl_attr_parser _nla_p_bsdnet_link[] = {
+    { .type = IFLA_IFNAME, .off = _OUT(ifla_ifname), .cb = snl_attr_get_string },
+    { .type = IFLA_MTU, .off = _OUT(ifla_mtu), .cb = snl_attr_get_uint32 },
+    { .type = IFLA_OPERSTATE, .off = _OUT(ifla_operstate), .cb = snl_attr_get_uint8 },
+};
+static struct snl_field_parser _fp_p_bsdnet_link[] = {
+    { .off_in = _IN(ifi_index), .off_out = _OUT(ifi_index), .cb = snl_field_get_uint32 },
+    { .off_in = _IN(ifi_type), .off_out = _OUT(ifi_type), .cb = snl_field_get_uint16 },
+    { .off_in = _IN(ifi_flags), .off_out = _OUT(ifi_flags), .cb = snl_field_get_uint32 },
+};
+#undef _IN
+#undef _OUT
+SNL_DECLARE_PARSER(bsdnet_rtm_link_parser, struct ifinfomsg, _fp_p_bsdnet_link, _nla_p_bsdnet_link);
+
+/*
+ * neighbor (arp/ndp) entries, mirrored by bsdnet_parsed_neigh in bsdnet.py
+ */
+struct bsdnet_parsed_neigh {
+    uint8_t ndm_family;
+    uint8_t ndm_flags;
+    uint16_t ndm_state;
+    uint32_t nda_ifindex;
+    struct sockaddr *nda_dst;
+};
+
+#define _IN(_field) offsetof(struct ndmsg, _field)
+#define _OUT(_field) offsetof(struct bsdnet_parsed_neigh, _field)
+static struct snl_attr_parser _nla_p_bsdnet_neigh[] = {
+    { .type = NDA_DST, .off = _OUT(nda_dst), .cb = snl_attr_get_ip },
+    { .type = NDA_IFINDEX, .off = _OUT(nda_ifindex), .cb = snl_attr_get_uint32 },
+};
+static struct snl_field_parser _fp_p_bsdnet_neigh[] = {
+    { .off_in = _IN(ndm_family), .off_out = _OUT(ndm_family), .cb = snl_field_get_uint8 },
+    { .off_in = _IN(ndm_flags), .off_out = _OUT(ndm_flags), .cb = snl_field_get_uint8 },
+    { .off_in = _IN(ndm_state), .off_out = _OUT(ndm_state), .cb = snl_field_get_uint16 },
+    { .off_in = _IN(ndm_ifindex), .off_out = _OUT(nda_ifindex), .cb = snl_field_get_uint32 },
+};
+#undef _IN
+#undef _OUT
+SNL_DECLARE_PARSER(bsdnet_rtm_neigh_parser, struct ndmsg, _fp_p_bsdnet_neigh, _nla_p_bsdnet_neigh);
+
+/*
+ * builds a complete RTM_NEWROUTE/RTM_DELROUTE in a single call and returns a copy
+ * of it as a bytearray, an empty gw means no gateway and an oif of 0 means no oif
+ */
+static PyObject *bsdnet_snl_build_route_msg(PyObject *self, PyObject *args) {
+    struct snl_state *ss;
+    int nlmsg_type;
+    int nlmsg_flags;
+    uint32_t fib;
+    int family;
+    const char *dst;
+    Py_ssize_t dst_size;
+    int dst_len;
+    const char *gw;
+    Py_ssize_t gw_size;
+    uint32_t oif;
+    uint32_t rtflags;
+    if (!PyArg_ParseTuple(args, "LiiIiy#iy#II", &ss, &nlmsg_type, &nlmsg_flags, &fib,
+            &family, &dst, &dst_size, &dst_len, &gw, &gw_size, &oif, &rtflags)) {
+        return NULL;
+    }
+    struct snl_writer nw;
+    errno = 0;
+    snl_init_writer(ss, &nw);
+    /* NOTE the writer may move the message as it grows, fill in as we go */
+    struct nlmsghdr *hdr = snl_create_msg_request(&nw, nlmsg_type);
+    if (hdr != NULL) {
+        hdr->nlmsg_flags |= nlmsg_flags;
+    }
+    struct rtmsg *rtm = snl_reserve_msg_object(&nw, struct rtmsg);
+    if (rtm != NULL) {
+        rtm->rtm_family = family;
+        rtm->rtm_dst_len = dst_len;
+        rtm->rtm_protocol = RTPROT_STATIC;
+        rtm->rtm_type = RTN_UNICAST;
+    }
+    snl_add_msg_attr(&nw, RTA_DST, dst_size, dst);
+    snl_add_msg_attr_u32(&nw, RTA_TABLE, fib);
+    snl_add_msg_attr_u32(&nw, NL_RTA_RTFLAGS, rtflags);
+    if (gw_size > 0) {
+        snl_add_msg_attr(&nw, RTA_GATEWAY, gw_size, gw);
+    }
+    if (oif != 0) {
+        snl_add_msg_attr_u32(&nw, RTA_OIF, oif);
+    }
+    hdr = snl_finalize_msg(&nw);
+    PyObject *msg;
+    if (hdr == NULL || nw.error) {
+        msg = PyErr_NoMemory();
+    } else {
+        msg = PyByteArray_FromStringAndSize((const char *)hdr, hdr->nlmsg_len);
+    }
+    snl_clear_lb(ss);
+    return msg;
+}
+
 static PyMethodDef bsdnet_methods[] = {
     {"snl_init", bsdnet_snl_init, METH_VARARGS, NULL},
     {"snl_free", bsdnet_snl_free, METH_VARARGS, NULL},
@@ -217,11 +569,14 @@ static PyMethodDef bsdnet_methods[] = {
     {"snl_read_reply", bsdnet_snl_read_reply, METH_VARARGS, NULL},
     {"snl_parse_nlmsg", bsdnet_snl_parse_nlmsg, METH_VARARGS, NULL},
     {"snl_read_message", bsdnet_snl_read_message, METH_VARARGS, NULL},
+    {"snl_read_message_filtered", bsdnet_snl_read_message_filtered, METH_VARARGS, NULL},
+    {"snl_read_reply_multi_filtered", bsdnet_snl_read_reply_multi_filtered, METH_VARARGS, NULL},
     {"snl_init_writer", bsdnet_snl_init_writer, METH_VARARGS, NULL},
     {"snl_create_msg_request", bsdnet_snl_create_msg_request, METH_VARARGS, NULL},
     {"snl_reserve_msg_data_raw", bsdnet_snl_reserve_msg_data_raw, METH_VARARGS, NULL},
     {"snl_add_msg_attr", bsdnet_snl_add_msg_attr, METH_VARARGS, NULL},
     {"snl_finalize_msg", bsdnet_snl_finalize_msg, METH_VARARGS, NULL},
+    {"snl_build_route_msg", bsdnet_snl_build_route_msg, METH_VARARGS, NULL},
     {NULL, NULL, 0, NULL}
 };
 
@@ -239,6 +594,8 @@ PyMODINIT_FUNC PyInit__bsdnet() {
     PyModule_AddIntConstant(module, "snl_rtm_route_parser", (long) &snl_rtm_route_parser);
     PyModule_AddIntConstant(module, "snl_rtm_addr_parser", (long) &snl_rtm_addr_parser);
     PyModule_AddIntConstant(module, "snl_rtm_link_parser", (long) &snl_rtm_link_parser);
+    PyModule_AddIntConstant(module, "bsdnet_rtm_link_parser", (long) &bsdnet_rtm_link_parser);
+    PyModule_AddIntConstant(module, "bsdnet_rtm_neigh_parser", (long) &bsdnet_rtm_neigh_parser);
 
     PyModule_AddIntConstant(module, "AF_NETLINK", AF_NETLINK);
     PyModule_AddIntConstant(module, "NETLINK_ROUTE", NETLINK_ROUTE);
@@ -246,10 +603,12 @@ PyMODINIT_FUNC PyInit__bsdnet() {
     PyModule_AddIntConstant(module, "NLM_F_REQUEST", NLM_F_REQUEST);
     PyModule_AddIntConstant(module, "NLM_F_CREATE", NLM_F_CREATE);
     PyModule_AddIntConstant(module, "NLM_F_EXCL", NLM_F_EXCL);
+    PyModule_AddIntConstant(module, "NLM_F_REPLACE", NLM_F_REPLACE);
     PyModule_AddIntConstant(module, "NLM_F_ACK", NLM_F_ACK);
     PyModule_AddIntConstant(module, "RTM_GETROUTE", RTM_GETROUTE);
     PyModule_AddIntConstant(module, "RTM_GETLINK", RTM_GETLINK);
     PyModule_AddIntConstant(module, "RTM_GETADDR", RTM_GETADDR);
+    PyModule_AddIntConstant(module, "RTM_GETNEIGH", RTM_GETNEIGH);
     PyModule_AddIntConstant(module, "RTA_TABLE", RTA_TABLE);
     PyModule_AddIntConstant(module, "RTNLGRP_LINK", RTNLGRP_LINK);
     PyModule_AddIntConstant(module, "RTNLGRP_NEIGH", RTNLGRP_NEIGH);
@@ -271,6 +630,15 @@ PyMODINIT_FUNC PyInit__bsdnet() {
     PyModule_AddIntConstant(module, "RTM_DELROUTE", RTM_DELROUTE);
     PyModule_AddIntConstant(module, "RTM_NEWNEIGH", RTM_NEWNEIGH);
     PyModule_AddIntConstant(module, "RTM_DELNEIGH", RTM_DELNEIGH);
+    PyModule_AddIntConstant(module, "NDA_DST", NDA_DST);
+    PyModule_AddIntConstant(module, "NUD_INCOMPLETE", NUD_INCOMPLETE);
+    PyModule_AddIntConstant(module, "NUD_REACHABLE", NUD_REACHABLE);
+    PyModule_AddIntConstant(module, "NUD_STALE", NUD_STALE);
+    PyModule_AddIntConstant(module, "NUD_DELAY", NUD_DELAY);
+    PyModule_AddIntConstant(module, "NUD_PROBE", NUD_PROBE);
+    PyModule_AddIntConstant(module, "NUD_FAILED", NUD_FAILED);
+    PyModule_AddIntConstant(module, "NUD_NOARP", NUD_NOARP);
+    PyModule_AddIntConstant(module, "NUD_PERMANENT", NUD_PERMANENT);
     PyModule_AddIntConstant(module, "RT_TABLE_MAIN", RT_TABLE_MAIN);
     PyModule_AddIntConstant(module, "RT_SCOPE_NOWHERE", RT_SCOPE_NOWHERE);
     PyModule_AddIntConstant(module, "RTPROT_BOOT", RTPROT_BOOT);
@@ -281,10 +649,23 @@ PyMODINIT_FUNC PyInit__bsdnet() {
     PyModule_AddIntConstant(module, "RTA_DST", RTA_DST);
     PyModule_AddIntConstant(module, "RTA_OIF", RTA_OIF);
     PyModule_AddIntConstant(module, "IFLA_IFNAME", IFLA_IFNAME);
+    PyModule_AddIntConstant(module, "IF_OPER_UNKNOWN", IF_OPER_UNKNOWN);
+    PyModule_AddIntConstant(module, "IF_OPER_NOTPRESENT", IF_OPER_NOTPRESENT);
+    PyModule_AddIntConstant(module, "IF_OPER_DOWN", IF_OPER_DOWN);
+    PyModule_AddIntConstant(module, "IF_OPER_LOWERLAYERDOWN", IF_OPER_LOWERLAYERDOWN);
+    PyModule_AddIntConstant(module, "IF_OPER_TESTING", IF_OPER_TESTING);
+    PyModule_AddIntConstant(module, "IF_OPER_DORMANT", IF_OPER_DORMANT);
+    PyModule_AddIntConstant(module, "IF_OPER_UP", IF_OPER_UP);
 
     PyModule_AddIntConstant(module, "IFF_UP", IFF_UP);
+    PyModule_AddIntConstant(module, "IFF_RUNNING", IFF_RUNNING);
     PyModule_AddIntConstant(module, "IF_NAMESIZE", IF_NAMESIZE);
     
+    PyModule_AddIntConstant(module, "NL_FILTER_MAX_IFS", NL_FILTER_MAX_IFS);
+    PyModule_AddIntConstant(module, "NL_FILTER_MAX_PREFIXES", NL_FILTER_MAX_PREFIXES);
+    PyModule_AddIntConstant(module, "NL_FILTER_AF_INET", NL_FILTER_AF_INET);
+    PyModule_AddIntConstant(module, "NL_FILTER_AF_INET6", NL_FILTER_AF_INET6);
+
     PyModule_AddIntConstant(module, "RTF_GATEWAY", RTF_GATEWAY);
     PyModule_AddIntConstant(module, "RTF_HOST", RTF_HOST);
     PyModule_AddIntConstant(module, "RTF_STATIC", RTF_STATIC);
@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+
+import argparse
+import os
+import signal
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+# NOTE
+#   Wall time of defaultconf runs the way the hooks make them, add and remove
+#   in turn against a scratch state, config and config cache.  The state update
+#   signals this process, which ignores it, so the signal is part of the cost.
+#   A bare interpreter is timed the same way, the target is for what defaultconf
+#   adds to it, interpreter startup differs too much between machines.  Exits 1
+#   when the median over that is above the target.  --cold drops the config
+#   cache before every run.
+#
+#   Bytecode goes to a scratch pycache prefix and is written by an untimed
+#   first run, an installed package is byte compiled too, hooks never pay for
+#   compiling (PYTHONDONTWRITEBYTECODE would have every run do it).
+
+src = Path(__file__).resolve().parent.parent / 'src'
+
+# the cache path goes first, the rest is defaultconf's own command line
+run_code = '''import sys
+from pathlib import Path
+from defaultconf import common
+common.default_config_cache_path = Path(sys.argv.pop(1))
+from defaultconf.defaultconf import main
+main()
+'''
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-n', metavar='runs', type=int, default=20)
+    parser.add_argument('-t', metavar='target-ms', type=float, default=100)
+    parser.add_argument('--cold', action='store_true')
+    args = parser.parse_args()
+
+    signal.signal(signal.SIGUSR1, signal.SIG_IGN)
+    env = dict(os.environ)
+    env['PYTHONPATH'] = os.pathsep.join(filter(None, [str(src), env.get('PYTHONPATH')]))
+    env.pop('PYTHONDONTWRITEBYTECODE', None)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        tmp = Path(tmp)
+        env['PYTHONPYCACHEPREFIX'] = str(tmp / 'pycache')
+        config_path = tmp / 'defaultconf.yaml'
+        cache_path = tmp / 'defaultconf.config.cache'
+        pid_path = tmp / 'defaultconf.pid'
+        pid_path.write_text(str(os.getpid()))
+        config_path.write_text(f'state_path: {tmp / "defaultconf.state"}\n'
+                f'pid_path: {pid_path}\n'
+                'priority:\n'
+                '  - { af: AF_INET6, link: cltun }\n'
+                '  - { link: em0 }\n')
+        commands = [
+            ['add', '-f', 'inet', '-l', 'em0', '-p', 'dhcp', '-t', '3600', '192.0.2.1'],
+            ['remove', '-f', 'inet', '-l', 'em0', '-p', 'dhcp'],
+        ]
+        argv = [sys.executable, '-c', run_code, str(cache_path), '-c', str(config_path)]
+        subprocess.run(argv + commands[-1], env=env, check=True)
+        bare = []
+        for i in range(args.n):
+            start = time.perf_counter()
+            subprocess.run([sys.executable, '-c', 'pass'], env=env, check=True)
+            bare.append((time.perf_counter() - start) * 1000)
+        times = []
+        for i in range(args.n):
+            if args.cold:
+                cache_path.unlink(missing_ok=True)
+            start = time.perf_counter()
+            subprocess.run(argv + commands[i % len(commands)], env=env, check=True)
+            times.append((time.perf_counter() - start) * 1000)
+
+    median = statistics.median(times)
+    overhead = median - statistics.median(bare)
+    print(f'runs {len(times)} min {min(times):.1f}ms median {median:.1f}ms max {max(times):.1f}ms')
+    print(f'over a bare interpreter {overhead:.1f}ms, target {args.t:.0f}ms')
+    sys.exit(0 if overhead <= args.t else 1)
+
+if __name__ == '__main__':
+    main()
@@ -97,6 +97,23 @@ class snl_parsed_link_simple(Structure):
         copy.ifla_ifname = create_string_buffer(string_at(self.ifla_ifname))
         return copy
 
+# _bsdnet.c
+class bsdnet_parsed_link(Structure):
+
+    _fields_ = [
+        ('ifi_index', c_uint32),
+        ('ifla_mtu', c_uint32),
+        ('ifi_type', c_uint16),
+        ('ifi_flags', c_uint32),
+        ('ifla_operstate', c_uint8),
+        ('ifla_ifname', POINTER(c_char))
+    ]
+
+    def deepcopy(self):
+        copy = bsdnet_parsed_link.from_buffer_copy(self)
+        copy.ifla_ifname = create_string_buffer(string_at(self.ifla_ifname))
+        return copy
+
 # netlink/netlink_snl_route_parsers.h
 class rta_mpath(Structure):
 
@@ -186,6 +203,23 @@ class snl_parsed_addr(Structure):
         self.ifa_cacheinfo = c_void_p() # TODO
         return copy
 
+# _bsdnet.c
+class bsdnet_parsed_neigh(Structure):
+
+    _fields_ = [
+        ('ndm_family', c_uint8),
+        ('ndm_flags', c_uint8),
+        ('ndm_state', c_uint16),
+        ('nda_ifindex', c_uint32),
+        ('nda_dst', POINTER(sockaddr))
+    ]
+
+    def deepcopy(self):
+        copy = bsdnet_parsed_neigh.from_buffer_copy(self)
+        if self.nda_dst:
+            copy.nda_dst = pointer(self.nda_dst.contents.deepcopy())
+        return copy
+
 # netlink/route/route.h
 class rtattr(Structure):
 
@@ -206,6 +240,28 @@ class snl_writer(Structure):
         ('error', c_bool)
     ]
 
+# _bsdnet.c
+class nl_filter_prefix(Structure):
+
+    _fields_ = [
+        ('family', c_uint8),
+        ('len', c_uint8),
+        ('addr', c_uint8*16)
+    ]
+
+# _bsdnet.c
+class nl_filter(Structure):
+
+    _fields_ = [
+        ('enabled', c_uint32),
+        ('table', c_uint32),
+        ('af_mask', c_uint32),
+        ('num_ifs', c_uint32),
+        ('ifs', c_uint32*NL_FILTER_MAX_IFS),
+        ('num_prefixes', c_uint32),
+        ('prefixes', nl_filter_prefix*NL_FILTER_MAX_PREFIXES)
+    ]
+
 # NOTE everything is copied coming out of here, it's a perf hit but makes things predictable
 # NOTE what is NOT performed though is the modification of memory addresses in the copies,
 #   see examples of deepcopy for how this can be handled
@@ -261,10 +317,19 @@ class SNL:
         memmove(buf, _hdr, hdr.nlmsg_len)
         return nlmsghdr.from_buffer(buf)
 
-    def read_message(self, *, timeout=None):
-        read_op = lambda:snl_read_message(addressof(self.ss))
+    # nl_filter drops irrelevant messages in c, before they are copied or parsed
+    #   returns None when the c side gave up after skipping a batch, so a caller
+    #   can pass a newer filter on the next read
+    def read_message(self, *, timeout=None, nl_filter=None):
+        if nl_filter is None:
+            read_op = lambda:snl_read_message(addressof(self.ss))
+        else:
+            read_op = lambda:snl_read_message_filtered(addressof(self.ss), addressof(nl_filter))
         _hdr = self._read_with_timeout(read_op, timeout)
-        assert _hdr
+        if nl_filter is None:
+            assert _hdr
+        elif not _hdr:
+            return None
         return SNL._copy_hdr(_hdr)
 
     def read_reply(self, nlmsg_seq, *, timeout=None):
@@ -281,9 +346,12 @@ class SNL:
             error_msg = os.strerror(e.error)
         raise OSError(e.error, error_msg)
 
-    def read_reply_multi(self, nlmsg_seq, *, timeout=None):
+    def read_reply_multi(self, nlmsg_seq, *, timeout=None, nl_filter=None):
         e = snl_errmsg_data()
-        read_op = lambda:snl_read_reply_multi(addressof(self.ss), nlmsg_seq, addressof(e))
+        if nl_filter is None:
+            read_op = lambda:snl_read_reply_multi(addressof(self.ss), nlmsg_seq, addressof(e))
+        else:
+            read_op = lambda:snl_read_reply_multi_filtered(addressof(self.ss), nlmsg_seq, addressof(e), addressof(nl_filter))
         _hdr = self._read_with_timeout(read_op, timeout)
         if e.error:
             SNL._handle_error(e)
@@ -311,6 +379,12 @@ class SNL:
     def new_writer(self):
         return SNLWriter(self)
 
+    # one call into c for a whole route message, gw/oif may be empty/0
+    def build_route_msg(self, nlmsg_type, nlmsg_flags, fib, family, dst, dst_len, gw, oif, rtflags):
+        buf = snl_build_route_msg(addressof(self.ss), nlmsg_type, nlmsg_flags, fib,
+                family, dst, dst_len, gw, oif, rtflags)
+        return nlmsghdr.from_buffer(buf)
+
     def _clear_lb(self):
         snl_clear_lb(addressof(self.ss))
 
@@ -322,6 +396,7 @@ class SNL:
             snl_free(addressof(ss))
 
 # NOTE
+#   Generic message building only, route messages have a native builder (build_route_msg)
 #   This odd class records a series of operations on an SNLWriter, but doesn't
 #   actually execute them until we finalize.  This way we don't have to worry about
 #   bad memory references from reallocations and clear_lb.  This is still less code
@@ -394,6 +469,8 @@ class SNLWriter:
 
 Parser = namedtuple('Parser', ['c_fn_p', 't'])
 snl_rtm_link_parser_simple = Parser(snl_rtm_link_parser_simple, snl_parsed_link_simple)
+bsdnet_rtm_link_parser = Parser(bsdnet_rtm_link_parser, bsdnet_parsed_link)
+bsdnet_rtm_neigh_parser = Parser(bsdnet_rtm_neigh_parser, bsdnet_parsed_neigh)
 snl_rtm_addr_parser = Parser(snl_rtm_addr_parser, snl_parsed_addr)
 snl_rtm_route_parser = Parser(snl_rtm_route_parser, snl_parsed_route)
 
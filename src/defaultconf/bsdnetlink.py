@@ -2,6 +2,7 @@
 
 from hashlib import sha256
 import ctypes
+import errno
 import logging
 import os
 from pathlib import *
@@ -16,19 +17,22 @@ import json
 import argparse
 
 from .bsdnet import *
+from .netaddr import *
+from .rtable import *
 
 # TODO fib shit for all of this stuff
 
+# sockaddr to int, see netaddr
 def parse_addr(addr):
     if addr.sa_family == socket.AF_INET:
         addr_in = sockaddr_in.from_sockaddr(addr)
-        return ip_address(bytes(addr_in.sin_addr))
+        return from_packed(bytes(addr_in.sin_addr))
     elif addr.sa_family == socket.AF_INET6:
         addr6_in = sockaddr_in6.from_sockaddr(addr)
-        return ip_address(bytes(addr6_in.sin6_addr))
+        return from_packed(bytes(addr6_in.sin6_addr))
     else:
         raise Exception(f'unsupported sa_family: {addr.sa_family}')
-   
+
 def dump_links(snl):
     nw = snl.new_writer()
     hdr = nw.create_msg_request(RTM_GETLINK)
@@ -39,17 +43,17 @@ def dump_links(snl):
     while hdr := snl.read_reply_multi(hdr.nlmsg_seq):
         yield parse_nlmsg_link(snl, hdr)
 
-def dump_addrs(snl):
+def dump_addrs(snl, *, nl_filter=None):
     nw = snl.new_writer()
     hdr = nw.create_msg_request(RTM_GETADDR)
     hdr.nlmsg_flags |= NLM_F_DUMP
     hdr = nw.finalize_msg()
 
     snl.send_message(hdr)
-    while hdr := snl.read_reply_multi(hdr.nlmsg_seq):
+    while hdr := snl.read_reply_multi(hdr.nlmsg_seq, nl_filter=nl_filter):
         yield parse_nlmsg_addr(snl, hdr)
 
-def dump_routes(snl, *, fib=None):
+def dump_routes(snl, *, fib=None, nl_filter=None):
     fib = 0 if fib is None else fib
     nw = snl.new_writer()
     hdr = nw.create_msg_request(RTM_GETROUTE)
@@ -59,11 +63,21 @@ def dump_routes(snl, *, fib=None):
     hdr = nw.finalize_msg()
 
     snl.send_message(hdr)
-    while hdr := snl.read_reply_multi(hdr.nlmsg_seq):
+    while hdr := snl.read_reply_multi(hdr.nlmsg_seq, nl_filter=nl_filter):
         yield parse_nlmsg_route(snl, hdr)
 
+def dump_neighs(snl, *, nl_filter=None):
+    nw = snl.new_writer()
+    hdr = nw.create_msg_request(RTM_GETNEIGH)
+    hdr.nlmsg_flags |= NLM_F_DUMP
+    hdr = nw.finalize_msg()
+
+    snl.send_message(hdr)
+    while hdr := snl.read_reply_multi(hdr.nlmsg_seq, nl_filter=nl_filter):
+        yield parse_nlmsg_neigh(snl, hdr)
+
 def parse_nlmsg_link(snl, hdr):
-    return snl.parse_nlmsg(hdr, snl_rtm_link_parser_simple)
+    return snl.parse_nlmsg(hdr, bsdnet_rtm_link_parser)
 
 def parse_nlmsg_addr(snl, hdr):
     return snl.parse_nlmsg(hdr, snl_rtm_addr_parser)
@@ -71,6 +85,9 @@ def parse_nlmsg_addr(snl, hdr):
 def parse_nlmsg_route(snl, hdr):
     return snl.parse_nlmsg(hdr, snl_rtm_route_parser)
 
+def parse_nlmsg_neigh(snl, hdr):
+    return snl.parse_nlmsg(hdr, bsdnet_rtm_neigh_parser)
+
 def parse_nlmsg(snl, hdr):
     if hdr.nlmsg_type in (RTM_NEWLINK, RTM_DELLINK):
         nlmsg = parse_nlmsg_link(snl, hdr)
@@ -78,77 +95,111 @@ def parse_nlmsg(snl, hdr):
         nlmsg = parse_nlmsg_addr(snl, hdr)
     elif hdr.nlmsg_type in (RTM_NEWROUTE, RTM_DELROUTE):
         nlmsg = parse_nlmsg_route(snl, hdr)
+    elif hdr.nlmsg_type in (RTM_NEWNEIGH, RTM_DELNEIGH):
+        nlmsg = parse_nlmsg_neigh(snl, hdr)
     else:
         raise Exception(f'unsupported nlmsg_type: {hdr.nlmsg_type}')
     return nlmsg
 
-def monitor_nl(ev, handler):
+# ask the kernel which route it would use for addr, None if unroutable
+def lookup_route(snl, af, addr, *, fib=None):
+    fib = 0 if fib is None else fib
+    nw = snl.new_writer()
+    hdr = nw.create_msg_request(RTM_GETROUTE)
+    rtm = nw.reserve_msg_object(rtmsg)
+    rtm.rtm_family = af
+    rtm.rtm_dst_len = addr_width(af)
+    dst_packed = to_packed(af, addr)
+    dst_data = (c_byte*len(dst_packed)).from_buffer_copy(dst_packed)
+    nw.add_msg_attr(RTA_DST, dst_data)
+    nw.add_msg_attr(RTA_TABLE, c_uint32(fib))
+    hdr = nw.finalize_msg()
+
+    snl.send_message(hdr)
+    try:
+        hdr = snl.read_reply_multi(hdr.nlmsg_seq)
+    except OSError as e:
+        if e.errno in (errno.ESRCH, errno.ENOENT, errno.ENETUNREACH, errno.EHOSTUNREACH):
+            return None
+        raise
+    if hdr is None:
+        return None
+    snl.read_reply_multi(hdr.nlmsg_seq)
+    return Route.from_snl_parsed_route(parse_nlmsg_route(snl, hdr))
+
+default_groups = [
+    RTNLGRP_LINK,
+    RTNLGRP_NEIGH,
+    RTNLGRP_IPV4_IFADDR,
+    RTNLGRP_IPV4_ROUTE,
+    RTNLGRP_IPV6_IFADDR,
+    RTNLGRP_IPV6_ROUTE
+]
+
+# get_nl_filter is consulted for every read, so the filter can be swapped underneath
+#   a filtered read returns empty handed every so often even under steady
+#   traffic that doesn't pass, see NL_FILTER_MAX_SKIP in _bsdnet.c
+def monitor_nl(ev, handler, *, groups=None, get_nl_filter=None):
+    groups = default_groups if groups is None else groups
+    get_nl_filter = (lambda: None) if get_nl_filter is None else get_nl_filter
     snl_event = SNL(NETLINK_ROUTE, read_timeout=1)
 # TODO is a helper necessary?
     snl_helper = SNL(NETLINK_ROUTE, read_timeout=1)
 
-    groups = [
-        RTNLGRP_LINK,
-        RTNLGRP_IPV4_IFADDR,
-        RTNLGRP_IPV4_ROUTE,
-        RTNLGRP_IPV6_IFADDR,
-        RTNLGRP_IPV6_ROUTE
-    ]
-
     snl_event.get_socket().setsockopt(SOL_NETLINK, NETLINK_MSG_INFO, 1)
     for group in groups:
         snl_event.get_socket().setsockopt(SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, group)
 
     while not ev.is_set():
         try:
-            hdr = snl_event.read_message()
+            hdr = snl_event.read_message(nl_filter=get_nl_filter())
         except BlockingIOError:
             continue
         if hdr:
             nlmsg = parse_nlmsg(snl_helper, hdr)
-            handler(hdr.nlmsg_type, nlmsg)
-
-def addr_to_af(addr):
-    if type(addr) is IPv4Address:
-        return socket.AF_INET
-    elif type(addr) is IPv6Address:
-        return socket.AF_INET6
-    elif type(addr) is IPv4Network:
-        return socket.AF_INET
-    elif type(addr) is IPv6Network:
-        return socket.AF_INET6
-    else:
-        raise Exception(f'unknown address type: {type(dst)}')
-
-def do_route(snl, fib, cmd, flags, dst, gw, if_idx):
-    nw = snl.new_writer()
-    hdr = nw.create_msg_request(cmd)
-    hdr.nlmsg_flags |= flags
-    rtm = nw.reserve_msg_object(rtmsg)
-    rtm.rtm_family = addr_to_af(dst)
-    rtm.rtm_protocol = RTPROT_STATIC 
-    rtm.rtm_type = RTN_UNICAST
-    rtm.rtm_dst_len = dst.prefixlen
-
-    dst_packed = dst.network_address.packed
-    dst_data = (c_byte*len(dst_packed)).from_buffer_copy(dst_packed)
-    nw.add_msg_attr(RTA_DST, dst_data) 
-    nw.add_msg_attr(RTA_TABLE, c_uint32(fib))
-
+            handler(hdr.nlmsg_type, nlmsg, hdr.nlmsg_flags)
+
+# what the daemon cares about, see nl_filter in _bsdnet.c
+#   afs is a set of af, ifs a set of link indexes and prefixes a set of (af, addr, prefixlen)
+NLFilterSpec = namedtuple('NLFilterSpec', ['table', 'afs', 'ifs', 'prefixes'])
+
+def build_nl_filter(spec):
+    if spec is None:
+        return None
+    if len(spec.ifs) > NL_FILTER_MAX_IFS or len(spec.prefixes) > NL_FILTER_MAX_PREFIXES:
+        # too wide to express, let everything through
+        logging.warning('netlink filter too wide, disabling')
+        return None
+    f = nl_filter()
+    f.enabled = 1
+    f.table = spec.table
+    for af in spec.afs:
+        if af == socket.AF_INET:
+            f.af_mask |= NL_FILTER_AF_INET
+        elif af == socket.AF_INET6:
+            f.af_mask |= NL_FILTER_AF_INET6
+    for i, ifindex in enumerate(sorted(spec.ifs)):
+        f.ifs[i] = ifindex
+    f.num_ifs = len(spec.ifs)
+    for i, (af, addr, prefixlen) in enumerate(sorted(spec.prefixes)):
+        packed = to_packed(af, addr)
+        f.prefixes[i].family = af
+        f.prefixes[i].len = prefixlen
+        memmove(f.prefixes[i].addr, packed, len(packed))
+    f.num_prefixes = len(spec.prefixes)
+    return f
+
+def build_route_msg(snl, fib, cmd, flags, af, dst, dst_len, gw, if_idx):
+    dst_packed = to_packed(af, dst)
+    gw_packed = b'' if gw is None else to_packed(af, gw)
     # the netlink rtm.rtm_protocol seems to be ignored
-    rtm_flags = RTF_STATIC 
-    nw.add_msg_attr(NL_RTA_RTFLAGS, c_uint32(rtm_flags))
-
-    if gw:
-        assert addr_to_af(dst) == addr_to_af(gw)
-        gw_data = (c_byte*len(gw.packed)).from_buffer_copy(gw.packed)
-        nw.add_msg_attr(RTA_GATEWAY, gw_data)
-
+    rtm_flags = RTF_STATIC
     # this is optional, but i should provide to be explicit
-    if if_idx:
-        nw.add_msg_attr(RTA_OIF, c_uint32(if_idx))
+    if_idx = 0 if if_idx is None else if_idx
+    return snl.build_route_msg(cmd, flags, fib, af, dst_packed, dst_len, gw_packed, if_idx, rtm_flags)
 
-    hdr = nw.finalize_msg()
+def do_route(snl, fib, cmd, flags, af, dst, dst_len, gw, if_idx):
+    hdr = build_route_msg(snl, fib, cmd, flags, af, dst, dst_len, gw, if_idx)
     snl.send_message(hdr)
     snl.read_reply_code(hdr.nlmsg_seq)
 
@@ -165,70 +216,168 @@ def if_nametoindex(snl, ifname):
     snl.read_reply_multi(hdr.nlmsg_seq)
     return snl.parse_nlmsg(hdr, snl_rtm_link_parser_simple).ifi_index
 
-def new_route(snl, fib, dst, gw, if_idx):
+def new_route(snl, fib, af, dst, dst_len, gw, if_idx):
     nl_cmd = RTM_NEWROUTE
     nl_flags = NLM_F_CREATE | NLM_F_EXCL
-    do_route(snl, fib, nl_cmd, nl_flags, dst, gw, if_idx)
+    do_route(snl, fib, nl_cmd, nl_flags, af, dst, dst_len, gw, if_idx)
 
-def delete_route(snl, fib, dst, gw, if_idx):
+def delete_route(snl, fib, af, dst, dst_len, gw, if_idx):
     nl_cmd = RTM_DELROUTE
     nl_flags = 0
-    do_route(snl, fib, nl_cmd, nl_flags, dst, gw, if_idx)
+    do_route(snl, fib, nl_cmd, nl_flags, af, dst, dst_len, gw, if_idx)
 
 # nettables
 class JSONEncoder(json.JSONEncoder):
 
     def default(self, o):
-        if type(o) in [IPv4Address, IPv4Network, IPv4Interface]:
-            return str(o)
-        elif type(o) in [IPv6Address, IPv6Network, IPv6Interface]:
-            return str(o)
-        elif type(o) is NetTables:
-            return { 'links': o.links, 'routes': o.routes, 'addrs': o.addrs }
+        if type(o) is NetTables:
+            links = o.get_links(lambda e: True)
+            routes = [ e.to_data() for e in o.get_routes(lambda e: True) ]
+            addrs = [ e.to_data() for e in o.get_addrs(lambda e: True) ]
+            neighs = [ e.to_data() for e in list(o.neighs.values()) ]
+            return { 'links': links, 'routes': routes, 'addrs': addrs, 'neighs': neighs }
         elif type(o) is set:
             return list(o)
         return json.JSONEncoder.default(self, o)
 
-class Link(namedtuple('Link', ['name', 'index', 'up'])):
+# up is administrative (IFF_UP), running is the driver (IFF_RUNNING) and carrier
+#   comes from the operational state, unknown counts as carrier like most
+#   pseudo interfaces report it
+class Link(namedtuple('Link', ['name', 'index', 'up', 'running', 'carrier', 'operstate', 'mtu', 'type'])):
 
     @staticmethod
-    def from_snl_parsed_link_simple(s):
+    def from_snl_parsed_link(s):
         name = string_at(s.ifla_ifname).decode()
         up_flag = bool(s.ifi_flags & IFF_UP)
-        return Link(name, s.ifi_index, up_flag) 
+        running_flag = bool(s.ifi_flags & IFF_RUNNING)
+        carrier_flag = s.ifla_operstate in (IF_OPER_UP, IF_OPER_UNKNOWN)
+        return Link(name, s.ifi_index, up_flag, running_flag, carrier_flag,
+                s.ifla_operstate, s.ifla_mtu, s.ifi_type)
+
+    # can the link carry traffic at all
+    @property
+    def live(self):
+        return self.up and self.running and self.carrier
 
-class LinkAddress(namedtuple('LinkAddress', ['link_index', 'address'])):
+# addresses are ints, see netaddr
+class LinkAddress(namedtuple('LinkAddress', ['af', 'link_index', 'addr', 'prefixlen'])):
 
     @staticmethod
     def from_snl_parsed_addr(s):
         local = parse_addr(s.ifa_local.contents) if s.ifa_local else None
         # NOTE, this project doesn't need the peer address
         addr = parse_addr(s.ifa_address.contents) if local is None else local
-        ifaceaddr = ip_interface((addr, s.ifa_prefixlen,))
-        return LinkAddress(s.ifa_index, ifaceaddr)
+        return LinkAddress(s.ifa_family, s.ifa_index, addr, s.ifa_prefixlen)
 
-class Route(namedtuple('Route', ['dst', 'gw', 'link_index'])):
+    def to_data(self):
+        addr = to_ip_address(self.af, self.addr)
+        return { 'link_index': self.link_index, 'address': f'{addr}/{self.prefixlen}' }
+
+# addresses are ints, see netaddr
+class Route(namedtuple('Route', ['af', 'dst', 'dst_len', 'gw', 'link_index'])):
 
     @staticmethod
     def from_snl_parsed_route(s):
         if s.rta_multipath.num_nhops != 0:
             raise Exception()
-        dst = ip_network((parse_addr(s.rta_dst.contents), s.rtm_dst_len))
+        dst = parse_addr(s.rta_dst.contents) if s.rta_dst else 0
         if s.rta_rtflags & RTF_GATEWAY:
             gw = parse_addr(s.rta_gw.contents)
         else:
             gw = None
-        return Route(dst, gw, s.rta_oif)
+        return Route(s.rtm_family, dst, s.rtm_dst_len, gw, s.rta_oif)
+
+    def to_data(self):
+        dst = to_ip_network(self.af, self.dst, self.dst_len)
+        gw = None if self.gw is None else str(to_ip_address(self.af, self.gw))
+        return { 'dst': str(dst), 'gw': gw, 'link_index': self.link_index }
 
+# arp/ndp entry, state is the NUD_* bitmask
+class Neighbor(namedtuple('Neighbor', ['af', 'link_index', 'addr', 'state'])):
+
+    @staticmethod
+    def from_snl_parsed_neigh(s):
+        return Neighbor(s.ndm_family, s.nda_ifindex, parse_addr(s.nda_dst.contents), s.ndm_state)
+
+    # resolution failed or never completed
+    @property
+    def failed(self):
+        return bool(self.state & (NUD_FAILED | NUD_INCOMPLETE))
+
+    # packets go out without waiting on resolution, stale ones are reconfirmed in the background
+    @property
+    def ready(self):
+        return bool(self.state & (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT | NUD_NOARP))
+
+    def to_data(self):
+        addr = to_ip_address(self.af, self.addr)
+        return { 'link_index': self.link_index, 'addr': str(addr), 'state': self.state }
+
+# NOTE
+#   with mirror_routes unset the fib is not mirrored at all, route questions are
+#   answered by RTM_GETROUTE lookups against the kernel instead.  Lookups are
+#   cached until invalidate_lookups, which is called for every event received
+#   and whenever we program a route ourselves.  Route events are still
+#   subscribed to for that, they invalidate but aren't stored.  A lookup only
+#   sees the best match for an address, not every route that contains it.
+#
+#   The lookup itself runs outside of lock, it may take up to read_timeout.
+#   Its result is only cached if no invalidation happened in the meantime.
 class NetTables:
 
     LinkAddresses = namedtuple('LinkAddresses', ['link', 'addrs'])
 
-    def __init__(self):
+    def __init__(self, *, fib=None, mirror_routes=None):
+        self.fib = 0 if fib is None else fib
+        self.mirror_routes = True if mirror_routes is None else mirror_routes
         self.lock = threading.RLock()
         self.links = set()
-        self.routes = set()
-        self.addrs = set()
+        # routes and addresses are stored compactly per af,
+        #   Route and LinkAddress are only built on the way out
+        self.routes = { af: RouteTable(af) for af in (socket.AF_INET, socket.AF_INET6) }
+        self.addrs = { af: AddrTable(af) for af in (socket.AF_INET, socket.AF_INET6) }
+        # (af, link_index, addr) -> Neighbor, only candidate gateways once the filter is set
+        self.neighs = {}
+        self.neighs_changed = threading.Condition(self.lock)
+        self.lookups = {}
+        self.lookups_gen = 0
+        self.lookup_snl = None
+        self.lookup_lock = threading.Lock()
+        # NOTE a published nl_filter is never modified, only replaced
+        self.nl_filter_spec = None
+        self.nl_filter = None
+
+    # returns True if the filter changed, the tables then need a resync
+    def set_filter(self, spec):
+        with self.lock:
+            if spec == self.nl_filter_spec:
+                return False
+            self.nl_filter_spec = spec
+            self.nl_filter = build_nl_filter(spec)
+            return True
+
+    # NOTE not to be called with lock held, see NOTE above
+    def _lookup(self, af, addr):
+        key = (af, addr)
+        with self.lock:
+            try:
+                return self.lookups[key]
+            except KeyError:
+                pass
+            gen = self.lookups_gen
+        with self.lookup_lock:
+            if self.lookup_snl is None:
+                self.lookup_snl = SNL(NETLINK_ROUTE, read_timeout=1)
+            route = lookup_route(self.lookup_snl, af, addr, fib=self.fib)
+        with self.lock:
+            if gen == self.lookups_gen:
+                self.lookups[key] = route
+        return route
+
+    def invalidate_lookups(self):
+        with self.lock:
+            self.lookups.clear()
+            self.lookups_gen += 1
 
     def new_link(self, link):
         with self.lock:
@@ -244,70 +393,183 @@ class NetTables:
         with self.lock:
             return set(filter(p, self.links))
 
+    def get_link_index(self, name):
+        with self.lock:
+            for link in self.links:
+                if link.name == name:
+                    return link.index
+            return None
+
     def new_addr(self, addr):
         with self.lock:
-            self.addrs.update({addr})
+            self.addrs[addr.af].add(addr.link_index, addr.addr, addr.prefixlen)
 
     def del_addr(self, addr):
         with self.lock:
-            self.addrs.difference_update({addr})
+            self.addrs[addr.af].remove(addr.link_index, addr.addr, addr.prefixlen)
 
     def get_addrs(self, p):
         with self.lock:
-            return set(filter(p, self.addrs))
+            addrs = set()
+            for af, table in self.addrs.items():
+                addrs.update(filter(p, (LinkAddress(af, *row) for row in table)))
+            return addrs
+
+    # is addr on the network of an address assigned to link_index
+    def addr_covers(self, af, link_index, addr):
+        with self.lock:
+            return self.addrs[af].covers(link_index, addr)
 
-    def new_route(self, route):
+    # replace as in NLM_F_REPLACE, the kernel announces a changed route that way
+    def new_route(self, route, *, replace=False):
         with self.lock:
-            self.routes.update({route})
+            table = self.routes[route.af]
+            (table.replace if replace else table.add)(route.dst, route.dst_len, route.gw, route.link_index)
 
     def del_route(self, route):
         with self.lock:
-            self.routes.difference_update({route})
+            self.routes[route.af].remove(route.dst, route.dst_len, route.gw, route.link_index)
 
-    def get_routes(self, p):
+    def new_neigh(self, neigh):
+        with self.lock:
+            self.neighs[(neigh.af, neigh.link_index, neigh.addr)] = neigh
+            self.neighs_changed.notify_all()
+
+    def del_neigh(self, neigh):
+        with self.lock:
+            self.neighs.pop((neigh.af, neigh.link_index, neigh.addr), None)
+
+    def get_neigh(self, af, link_index, addr):
+        with self.lock:
+            return self.neighs.get((af, link_index, addr))
+
+    # wait for the neighbor entry to become ready, returns whether it did
+    def wait_neigh_ready(self, af, link_index, addr, timeout):
+        def ready():
+            neigh = self.neighs.get((af, link_index, addr))
+            return neigh is not None and neigh.ready
         with self.lock:
-            return set(filter(p, self.routes))
+            return self.neighs_changed.wait_for(ready, timeout)
 
-def maintain_nettables(finish, trigger_ev, nettables):
+    # NOTE this materializes the whole table, use the lookups below where possible
+    def get_routes(self, p):
+        with self.lock:
+            routes = set()
+            for af, table in self.routes.items():
+                routes.update(filter(p, (Route(af, *row) for row in table)))
+            return routes
+
+    def get_route(self, af, dst, dst_len):
+        if self.mirror_routes:
+            with self.lock:
+                # ecmp next hops are several routes for the prefix, any of them will do
+                row = next(self.routes[af].get(dst, dst_len), None)
+                return None if row is None else Route(af, *row)
+        route = self._lookup(af, dst)
+        if route is None or (route.dst, route.dst_len) != (dst, dst_len):
+            return None
+        return route
+
+    # is there a route out link_index that contains addr
+    def route_covers(self, af, link_index, addr):
+        if self.mirror_routes:
+            with self.lock:
+                for row in self.routes[af].matches(addr):
+                    if row[3] == link_index:
+                        return True
+                return False
+        route = self._lookup(af, addr)
+        return route is not None and route.link_index == link_index
+
+# refill addrs, neighbors and routes through the current filter, anything it newly admits
+#   was dropped before and has to be fetched again
+def resync_nettables(nettables, snl):
+    with nettables.lock:
+        nl_filter = nettables.nl_filter
+        for table in nettables.addrs.values():
+            table.clear()
+        for addr in dump_addrs(snl, nl_filter=nl_filter):
+            nettables.new_addr(LinkAddress.from_snl_parsed_addr(addr))
+        nettables.neighs.clear()
+        for neigh in dump_neighs(snl, nl_filter=nl_filter):
+            nettables.new_neigh(Neighbor.from_snl_parsed_neigh(neigh))
+        if nettables.mirror_routes:
+            for table in nettables.routes.values():
+                table.clear()
+            for route in dump_routes(snl, fib=nettables.fib, nl_filter=nl_filter):
+                nettables.new_route(Route.from_snl_parsed_route(route))
+        nettables.invalidate_lookups()
+
+# did the link lose up/running/carrier, or go away entirely
+def link_is_down(nlmsg_type, nlmsg):
+    if nlmsg_type == RTM_DELLINK:
+        return True
+    elif nlmsg_type == RTM_NEWLINK:
+        return not Link.from_snl_parsed_link(nlmsg).live
+    return False
+
+# link_down is called with the Link from the netlink reader thread, before the
+#   message is queued, ie. ahead of every route and address event still pending
+def maintain_nettables(finish, trigger_ev, nettables, *, link_down=None):
     executor = concurrent.futures.ThreadPoolExecutor()
     tasks = []
     tasks.append(executor.submit(finish.wait))
 
     nlmsg_q = queue.Queue()
-    def handler(nlmsg_type, nlmsg):
-        nlmsg_q.put((nlmsg_type, nlmsg,))
-    tasks.append(executor.submit(monitor_nl, finish, handler))
+    def handler(nlmsg_type, nlmsg, nlmsg_flags):
+        if link_down is not None and link_is_down(nlmsg_type, nlmsg):
+            try:
+                link_down(Link.from_snl_parsed_link(nlmsg))
+            except Exception as e:
+                logging.error(e)
+        nlmsg_q.put((nlmsg_type, nlmsg, nlmsg_flags))
+    get_nl_filter = lambda: nettables.nl_filter
+    tasks.append(executor.submit(monitor_nl, finish, handler, get_nl_filter=get_nl_filter))
 
     # TODO close the gap
     with SNL(NETLINK_ROUTE, read_timeout=1) as snl:
         for link in dump_links(snl):
-            nettables.new_link(Link.from_snl_parsed_link_simple(link))
+            nettables.new_link(Link.from_snl_parsed_link(link))
         for addr in dump_addrs(snl):
             nettables.new_addr(LinkAddress.from_snl_parsed_addr(addr))
-        for route in dump_routes(snl):
-            nettables.new_route(Route.from_snl_parsed_route(route))
+        for neigh in dump_neighs(snl):
+            nettables.new_neigh(Neighbor.from_snl_parsed_neigh(neigh))
+        if nettables.mirror_routes:
+            for route in dump_routes(snl, fib=nettables.fib):
+                nettables.new_route(Route.from_snl_parsed_route(route))
     trigger_ev.release()
 
     def nlmsg_handler():
         while not finish.is_set():
             try:
-                nlmsg_type, nlmsg = nlmsg_q.get(timeout=1)
+                nlmsg_type, nlmsg, nlmsg_flags = nlmsg_q.get(timeout=1)
             except queue.Empty:
                 continue
             if nlmsg_type == RTM_NEWLINK:
-                nettables.new_link(Link.from_snl_parsed_link_simple(nlmsg))
+                nettables.new_link(Link.from_snl_parsed_link(nlmsg))
             elif nlmsg_type == RTM_DELLINK:
-                nettables.del_link(Link.from_snl_parsed_link_simple(nlmsg))
+                nettables.del_link(Link.from_snl_parsed_link(nlmsg))
             elif nlmsg_type == RTM_NEWADDR:
                 nettables.new_addr(LinkAddress.from_snl_parsed_addr(nlmsg))
             elif nlmsg_type == RTM_DELADDR:
                 nettables.del_addr(LinkAddress.from_snl_parsed_addr(nlmsg))
+            elif nlmsg_type in (RTM_NEWROUTE, RTM_DELROUTE) and not nettables.mirror_routes:
+                # only invalidates the lookups, see NetTables
+                pass
+            elif nlmsg_type in (RTM_NEWROUTE, RTM_DELROUTE) and nlmsg.rta_table != nettables.fib:
+                # other fibs get here while the nl filter isn't in force
+                pass
             elif nlmsg_type == RTM_NEWROUTE:
-                nettables.new_route(Route.from_snl_parsed_route(nlmsg))
+                nettables.new_route(Route.from_snl_parsed_route(nlmsg), replace=bool(nlmsg_flags & NLM_F_REPLACE))
             elif nlmsg_type == RTM_DELROUTE:
                 nettables.del_route(Route.from_snl_parsed_route(nlmsg))
+            elif nlmsg_type == RTM_NEWNEIGH:
+                nettables.new_neigh(Neighbor.from_snl_parsed_neigh(nlmsg))
+            elif nlmsg_type == RTM_DELNEIGH:
+                nettables.del_neigh(Neighbor.from_snl_parsed_neigh(nlmsg))
             else:
                 logging.error(f'unknown nlmsg_type: {nlmsg_type}')
+            nettables.invalidate_lookups()
             trigger_ev.release()
     tasks.append(executor.submit(nlmsg_handler))
 
@@ -333,6 +595,7 @@ def main():
     subparser.add_argument('-f', metavar='fib', type=int, default=0)
     subparsers.add_parser('dump-links')
     subparsers.add_parser('dump-addrs')
+    subparsers.add_parser('dump-neighs')
     subparser = subparsers.add_parser('dump-routes')
     subparser.add_argument('-f', metavar='fib', type=int, default=0)
     subparsers.add_parser('monitor-nl')
@@ -345,26 +608,34 @@ def main():
     if args.action is None:
         raise Exception('action not specified')
     elif args.action == 'new-route':
+        af, dst, dst_len = from_ip_network(args.d)
+        gw = None if args.g is None else from_ip_address(args.g)[1]
         if_idx = None if args.i is None else if_nametoindex(snl, args.i)
-        new_route(snl, args.f, args.d, args.g, if_idx)
+        new_route(snl, args.f, af, dst, dst_len, gw, if_idx)
     elif args.action == 'delete-route':
+        af, dst, dst_len = from_ip_network(args.d)
+        gw = None if args.g is None else from_ip_address(args.g)[1]
         if_idx = None if args.i is None else if_nametoindex(snl, args.i)
-        delete_route(snl, args.f, args.d, args.g, if_idx)
+        delete_route(snl, args.f, af, dst, dst_len, gw, if_idx)
     elif args.action == 'dump-links':
         for link in dump_links(snl):
-            l = Link.from_snl_parsed_link_simple(link)
+            l = Link.from_snl_parsed_link(link)
             print(l)
     elif args.action == 'dump-addrs':
         for addr in dump_addrs(snl):
             a = LinkAddress.from_snl_parsed_addr(addr)
-            print(a)
+            print(json.dumps(a.to_data()))
+    elif args.action == 'dump-neighs':
+        for neigh in dump_neighs(snl):
+            n = Neighbor.from_snl_parsed_neigh(neigh)
+            print(json.dumps(n.to_data()))
     elif args.action == 'dump-routes':
         for route in dump_routes(snl, fib=args.f):
             r = Route.from_snl_parsed_route(route)
-            print(r)
+            print(json.dumps(r.to_data()))
     elif args.action == 'monitor-nl':
         ev = threading.Event()
-        def handler(nlmsg_type, nlmsg):
+        def handler(nlmsg_type, nlmsg, nlmsg_flags):
             print(nlmsg)
         monitor_nl(ev, handler)
     elif args.action == 'if_nametoindex':
@@ -1,38 +1,73 @@
 #!/usr/bin/env python3
 
-import logging
 import signal
 import os
 import contextlib
 import time
 import socket
+import threading
 from collections import namedtuple
-import ipaddress
-import yaml
 import json
 from pathlib import Path
-import filelock 
+
+from .netaddr import *
+from . import journal
+from .metrics import performance_sort_strategy
 
 default_config_path = Path('/usr/local/etc/defaultconf.yaml')
 default_state_path = Path('/var/db/defaultconf.state')
 default_pid_path = Path('/var/run/defaultconf.pid')
+default_stats_path = Path('/var/run/defaultconf.stats')
+default_decision_path = Path('/var/run/defaultconf.decision')
+default_control_path = Path('/var/run/defaultconf.sock')
+default_config_cache_path = Path('/var/db/defaultconf.config.cache')
+
+# logging is a good part of a hook run's startup, it's imported and set up on
+#   first use, see main
+log_level = 'INFO'
+
+def set_log_level(level):
+    global log_level
+    log_level = level
 
+def get_logging():
+    import logging
+    if not logging.root.handlers:
+        logging.basicConfig(level=log_level)
+    return logging
+
+# newest registration first, within one registration the order it was given in
 def default_sort_strategy(e):
-    return e.ts
+    return (e.ts, -e.rank)
+
+# name -> factory taking the daemon's Measurements (None outside of it), returning the sort key
+sort_strategies = {
+    'registered': lambda measurements: default_sort_strategy,
+    'performance': performance_sort_strategy,
+}
+
+# addr is an int, see netaddr
+# rank orders the gateways registered together for one (af, link, protocol), 0 first
+# expires is the time.time() the gateway's lifetime ends, None if it doesn't
+class Gateway(namedtuple('Gateway', ['af', 'link', 'protocol', 'addr', 'ts', 'rank', 'expires'],
+            defaults=[0, None])):
 
-class Gateway(namedtuple('Gateway', ['af', 'link', 'protocol', 'addr', 'ts'])):
+    def expired(self, now):
+        return self.expires is not None and self.expires <= now
 
     @staticmethod
     def from_data(data):
         kwargs = dict(data)
         kwargs['af'] = socket.AddressFamily[data['af']]
-        kwargs['addr'] = ipaddress.ip_address(data['addr'])
+        af, kwargs['addr'] = parse_ip_address(data['addr'])
+        if af != kwargs['af']:
+            raise Exception(f'address family mismatch: {data["addr"]}')
         return Gateway(**kwargs)
 
     def to_data(self):
         data = self._asdict()
         data['af'] = self.af.name
-        data['addr'] = str(self.addr)
+        data['addr'] = format_ip_address(self.af, self.addr)
         return data
 
 class GatewaySelect(namedtuple('GatewaySelect', ['af', 'link', 'protocol'],
@@ -63,39 +98,146 @@ class GatewaySelect(namedtuple('GatewaySelect', ['af', 'link', 'protocol'],
             data['af'] = self.af.name
         return data
 
-class Config(namedtuple('Config', ['state_path', 'priority', 'pid_path', 'fib'],
-            defaults=[default_state_path, [], default_pid_path, 0])):
+class Config(namedtuple('Config', ['state_path', 'priority', 'pid_path', 'fib', 'mirror_routes',
+                'neigh_check', 'probe', 'sort_strategy', 'dampening', 'stats_path', 'neigh_prewarm', 'ra',
+                'dhcp_leases', 'decision_path', 'control_path'],
+            defaults=[default_state_path, [], default_pid_path, 0, True, False, None, 'registered', None,
+                default_stats_path, 0.2, None, None, default_decision_path, default_control_path])):
     
     @staticmethod
     def from_data(data):
         kwargs = dict(data)
+        if data.get('sort_strategy', 'registered') not in sort_strategies:
+            raise Exception(f'unknown sort strategy: {data["sort_strategy"]}')
         kwargs['priority'] = [ GatewaySelect.from_data(e) for e in data.get('priority', []) ]
+        # the daemon's parts are imported only when configured, hooks don't need them
+        if data.get('probe') is not None:
+            from .prober import ProbeConfig
+            kwargs['probe'] = ProbeConfig.from_data(data['probe'])
+        if data.get('dampening') is not None:
+            from .dampening import DampeningConfig
+            kwargs['dampening'] = DampeningConfig.from_data(data['dampening'])
+        if data.get('ra') is not None:
+            from .ra import RAConfig
+            kwargs['ra'] = RAConfig.from_data(data['ra'])
+        if data.get('state_path') is not None:
+            kwargs['state_path'] = Path(data['state_path'])
+        if data.get('pid_path') is not None:
+            kwargs['pid_path'] = Path(data['pid_path'])
+        if data.get('stats_path') is not None:
+            kwargs['stats_path'] = Path(data['stats_path'])
+        if data.get('decision_path') is not None:
+            kwargs['decision_path'] = Path(data['decision_path'])
+        if data.get('control_path') is not None:
+            kwargs['control_path'] = Path(data['control_path'])
         return Config(**kwargs)
 
     @staticmethod
-    def from_path(path):
-        if path.exists():
-            return Config.from_data(yaml.load(path.read_text(), Loader=yaml.SafeLoader))
-        return Config()
+    def from_path(path, *, cache_path=None):
+        data = read_config_data(path, default_config_cache_path if cache_path is None else cache_path)
+        if data is None:
+            return Config()
+        return Config.from_data(data)
+
+# NOTE
+#   yaml.load is by far the slowest part of a hook run.  The loaded config is
+#   kept as json in cache_path, keyed by the config's path, mtime and size, and
+#   used as long as the key still matches.  Not being able to write the cache
+#   (not root, read only /var) only costs the speedup.
+
+# the config file's data, None if there is none
+def read_config_data(path, cache_path):
+    try:
+        st = path.stat()
+    except FileNotFoundError:
+        return None
+    key = [str(path.absolute()), st.st_mtime_ns, st.st_size]
+    try:
+        cache = json.loads(cache_path.read_text())
+        if cache['key'] == key:
+            return cache['data']
+    except (OSError, ValueError, KeyError, TypeError):
+        pass
+    # only imported on a miss, it's a good part of the cost
+    import yaml
+    data = yaml.load(path.read_text(), Loader=yaml.SafeLoader)
+    try:
+        tmp = cache_path.with_name(f'.{cache_path.name}.{os.getpid()}.tmp')
+        tmp.write_text(json.dumps({ 'key': key, 'data': data }))
+        os.replace(tmp, cache_path)
+    except (OSError, TypeError, ValueError) as e:
+        get_logging().debug(f'{cache_path}: {e}')
+    return data
 
 class State(namedtuple('State', ['gateways', 'disabled'],
             defaults=[set(), set()])):
 
-    def add(self, af, link, protocol, addr):
+    # the mutations return the journal record of what they did, None if nothing changed
+
+    # addrs replaces the whole group of (af, link, protocol), in order of preference
+    #   lifetime is seconds for all of them, or a list with one per addr
+    def add(self, af, link, protocol, addrs, *, lifetime=None):
+        ts = time.time()
+        if not isinstance(lifetime, (list, tuple)):
+            lifetime = [lifetime] * len(addrs)
+        group = []
+        for addr, seconds in zip(addrs, lifetime):
+            if addr in (e.addr for e in group):
+                continue
+            expires = None if seconds is None else ts + seconds
+            group.append(Gateway(af, link, protocol, addr, ts, len(group), expires))
+        self._add(af, link, protocol, group)
+        return { 'op': 'add', 'af': af.name, 'link': link, 'protocol': protocol,
+                'gateways': [ e.to_data() for e in group ] }
+
+    def _add(self, af, link, protocol, group):
         # remove any other gateways that look like me
         self.remove(GatewaySelect(af, link, protocol))
-        self.gateways.update({Gateway(af, link, protocol, addr, time.time())})
+        self.gateways.update(group)
+
+    # drop gateways whose lifetime is over
+    def expire(self, now):
+        matches = set(filter(lambda e: e.expired(now), self.gateways))
+        if not matches:
+            return None
+        self.gateways.difference_update(matches)
+        return { 'op': 'expire', 'now': now }
 
     def remove(self, select):
         matches = set(filter(select.matches, self.gateways))
+        if not matches:
+            return None
         self.gateways.difference_update(matches)
+        return { 'op': 'remove', 'select': select.to_data() }
 
     def disable(self, select):
+        if select in self.disabled:
+            return None
         self.disabled.update({select})
+        return { 'op': 'disable', 'select': select.to_data() }
 
     def enable(self, select):
         matches = set(filter(select.matches, self.disabled))
+        if not matches:
+            return None
         self.disabled.difference_update(matches)
+        return { 'op': 'enable', 'select': select.to_data() }
+
+    # replay a journal record
+    def apply(self, op):
+        if op['op'] == 'add':
+            group = [ Gateway.from_data(e) for e in op['gateways'] ]
+            self._add(socket.AddressFamily[op['af']], op['link'], op['protocol'], group)
+        elif op['op'] == 'expire':
+            self.expire(op['now'])
+        elif op['op'] == 'remove':
+            self.remove(GatewaySelect.from_data(op['select']))
+        elif op['op'] == 'disable':
+            self.disable(GatewaySelect.from_data(op['select']))
+        elif op['op'] == 'enable':
+            self.enable(GatewaySelect.from_data(op['select']))
+        else:
+            raise Exception(f'unknown journal op: {op["op"]}')
 
     def deepcopy(self):
         return State.from_data(json.loads(json.dumps(self.to_data())))
@@ -113,43 +255,188 @@ class State(namedtuple('State', ['gateways', 'disabled'],
         data['disabled'] = [ e.to_data() for e in self.disabled ]
         return data
 
+    # snapshot plus journal, returns the state, its gen, and the journal's end offset and record count
+    @staticmethod
+    def load(path):
+        data, gen = journal.read_snapshot(path)
+        state = State(set(), set()) if data is None else State.from_data(data)
+        records, offset, count = journal.read_journal(path, gen)
+        for gen, ops in records:
+            for op in ops:
+                state.apply(op)
+        return state, gen, offset, count
+
     @staticmethod
     def from_path(path):
-        if path.exists():
-            return State.from_data(json.loads(path.read_text()))
-        return State()
+        return State.load(path)[0]
 
-    def to_path(self, path):
-        path.write_text(json.dumps(self.to_data()))
+    def to_path(self, path, gen=0):
+        journal.compact(path, gen, self.to_data())
 
     @staticmethod
     @contextlib.contextmanager
     def update(config):
         state_path = config.state_path
         state_lock_path = Path(f'{state_path}.lock')
-        with filelock.FileLock(state_lock_path):
-            state = State.from_path(state_path)
-            pre = json.dumps(state.to_data(), sort_keys=True)
-            yield state
-            post = json.dumps(state.to_data(), sort_keys=True)
-            if pre != post:
-                state.to_path(state_path)
-                try_signal_daemon(config)
+        end = None
+        with journal.file_lock(state_lock_path):
+            state, gen, offset, count = State.load(state_path)
+            transaction = StateTransaction(state)
+            # expired gateways are already ignored, this is just housekeeping
+            transaction.expire(time.time())
+            yield transaction
+            if transaction.ops:
+                gen += 1
+                if count + 1 >= journal.compact_records:
+                    state.to_path(state_path, gen)
+                else:
+                    end = journal.append_journal(state_path, gen, transaction.ops, offset)
+        # fsync outside the state lock so concurrent updates can share it
+        if end is not None:
+            journal.sync_journal(state_path, end)
+        if transaction.ops:
+            try_signal_daemon(config)
+
+# what changed between two states, gateways added and removed, selects enabled and disabled
+class StateDiff(namedtuple('StateDiff', ['added', 'removed', 'enabled', 'disabled'])):
+
+    @staticmethod
+    def between(old, new):
+        return StateDiff(new.gateways - old.gateways, old.gateways - new.gateways,
+                old.disabled - new.disabled, new.disabled - old.disabled)
+
+    # the afs whose defaults may have changed, empty if none
+    def afs(self):
+        afs = { e.af for e in self.added | self.removed }
+        for select in self.enabled | self.disabled:
+            if select.af is None:
+                return { socket.AF_INET, socket.AF_INET6 }
+            afs.add(select.af)
+        return afs
+
+# what State.update hands out, the mutations are collected as journal ops
+class StateTransaction:
+
+    def __init__(self, state):
+        self.state = state
+        self.ops = []
+
+    def __getattr__(self, name):
+        return getattr(self.state, name)
+
+    def _record(self, op):
+        if op is not None:
+            self.ops.append(op)
+        return op
+
+    def add(self, *args, **kwargs):
+        return self._record(self.state.add(*args, **kwargs))
+
+    def expire(self, *args, **kwargs):
+        return self._record(self.state.expire(*args, **kwargs))
+
+    def remove(self, *args, **kwargs):
+        return self._record(self.state.remove(*args, **kwargs))
+
+    def disable(self, *args, **kwargs):
+        return self._record(self.state.disable(*args, **kwargs))
+
+    def enable(self, *args, **kwargs):
+        return self._record(self.state.enable(*args, **kwargs))
+
+# gateway -> the first priority it matches, len(priority) if none does
+#   kept up to date with State by add and discard, so get_defaults doesn't
+#   run every gateway through the priority list on every call
+class PriorityIndex:
+
+    def __init__(self, priority, gateways=()):
+        self.priority = priority
+        self.buckets = {}
+        self.add(gateways)
+
+    def match(self, gateway):
+        for i, select in enumerate(self.priority):
+            if select.matches(gateway):
+                return i
+        return len(self.priority)
+
+    def add(self, gateways):
+        for gateway in gateways:
+            self.buckets[gateway] = self.match(gateway)
+
+    def discard(self, gateways):
+        for gateway in gateways:
+            self.buckets.pop(gateway, None)
+
+    def bucket(self, gateway):
+        i = self.buckets.get(gateway)
+        return self.match(gateway) if i is None else i
+
+# NOTE
+#   The daemon reloads State on every SIGUSR1.  While the snapshot stays the
+#   same only the journal past what was read last time is replayed, onto a
+#   copy, the state in use is never modified under get_defaults.  Compaction
+#   replaces the snapshot, that (or a snapshot replaced while reading the
+#   journal) means a full load.  Either way the result is diffed against the
+#   state held so far, and only the diff touches the index.
 
 class DefaultConf:
 
-    def __init__(self, config):
+    def __init__(self, config, *, measurements=None):
         self.config = config
-        self.sort_strategy = default_sort_strategy
+        self.sort_strategy = sort_strategies[config.sort_strategy](measurements)
+        self.state = State(set(), set())
+        self.gen = 0
+        self.offset = 0
+        self.snapshot = None
+        self.loaded = False
+        self.index = PriorityIndex(config.priority)
+        # reloads of state and config, get_defaults doesn't need it
+        self.lock = threading.Lock()
         self.reload_state()
 
+    # a new config, only the priority index is rebuilt, see reloadable_fields
+    def set_config(self, config):
+        with self.lock:
+            if config.priority != self.config.priority:
+                self.index = PriorityIndex(config.priority, self.state.gateways)
+            self.config = config
+
+    # returns the StateDiff against the state held before
     def reload_state(self):
-        self.state = State.from_path(self.config.state_path)
+        with self.lock:
+            state_path = self.config.state_path
+            snapshot = journal.snapshot_id(state_path)
+            state = None
+            if self.loaded and snapshot == self.snapshot:
+                records, offset, _ = journal.read_journal(state_path, self.gen, self.offset)
+                if journal.snapshot_id(state_path) == snapshot:
+                    state = State(set(self.state.gateways), set(self.state.disabled))
+                    gen = self.gen
+                    for gen, ops in records:
+                        for op in ops:
+                            state.apply(op)
+            while state is None:
+                state, gen, offset, _ = State.load(state_path)
+                # compacted while loading, the journal may have been cut under us
+                if journal.snapshot_id(state_path) != snapshot:
+                    snapshot = journal.snapshot_id(state_path)
+                    state = None
+            diff = StateDiff.between(self.state, state)
+            # new gateways go into the index before the state that has them, old ones leave after
+            self.index.add(diff.added)
+            self.state = state
+            self.index.discard(diff.removed)
+            self.gen, self.offset, self.snapshot = gen, offset, snapshot
+            self.loaded = True
+            return diff
 
     def get_defaults(self, select):
         # save state instance incase we reload
         state = self.state
         defaults = filter(select.matches, state.gateways)
+        now = time.time()
+        defaults = filter(lambda e: not e.expired(now), defaults)
 
         def enabled_filter(e):
             for disabled in state.disabled:
@@ -158,19 +445,11 @@ class DefaultConf:
             return True
         defaults = filter(enabled_filter, defaults)
         
-        # run the defaults through the priority list
-        # one at a time until a bucket matches
-        # 1) for every priority, find ifaces that match it
-        by_priority = [ [] for i in range(len(self.config.priority)+1) ]
+        # 1) for every priority, find ifaces that match it, see PriorityIndex
+        index = self.index
+        by_priority = [ [] for i in range(len(index.priority)+1) ]
         for default in defaults:
-            match_found = False
-            for i in range(len(self.config.priority)):
-                if self.config.priority[i].matches(default):
-                    by_priority[i].append(default)
-                    match_found = True
-                    break
-            if not match_found:
-                by_priority[-1].append(default)
+            by_priority[index.bucket(default)].append(default)
         # 2) for all priority buckets, sort them and append the output
         defaults = []
         for bucket in by_priority:
@@ -185,7 +464,7 @@ def try_signal_daemon(config, *, ignore_failure=None):
         os.kill(pid, signal.SIGUSR1)
     except Exception as e:
         if ignore_failure:
-            logging.error(e)
+            get_logging().error(e)
         else:
             raise
 
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+
+import json
+import logging
+import os
+import select
+import socket
+import threading
+
+# NOTE
+#   A unix socket the daemon listens on, one json request per line in, json
+#   lines out.  `watch` keeps the connection and streams every change of the
+#   default as it happens, starting with the current ones.  Watchers that
+#   can't keep up (a full socket buffer) are dropped rather than stalling the
+#   daemon, they can reconnect and get the current state again.
+
+class ControlServer:
+
+    def __init__(self, path):
+        self.path = path
+        self.lock = threading.Lock()
+        self.watchers = []
+        self.current = {}
+        self.commands = { 'watch': self._watch }
+        try:
+            os.unlink(path)
+        except FileNotFoundError:
+            pass
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.bind(str(path))
+        os.chmod(path, 0o660)
+        self.sock.listen()
+
+    # handler(conn, request) returns a response to send, or None when it took the connection
+    def register(self, name, handler):
+        self.commands[name] = handler
+
+    def _watch(self, conn, request):
+        with self.lock:
+            conn.setblocking(False)
+            for event in self.current.values():
+                self._send(conn, event)
+            self.watchers.append(conn)
+        return None
+
+    def _send(self, conn, event):
+        try:
+            conn.sendall(json.dumps(event).encode() + b'\n')
+            return True
+        except OSError:
+            return False
+
+    # event is a dict with at least af, the latest per af is replayed to new watchers
+    def notify(self, event):
+        with self.lock:
+            self.current[event['af']] = event
+            for conn in list(self.watchers):
+                if not self._send(conn, event):
+                    self.watchers.remove(conn)
+                    conn.close()
+
+    def _handle(self, conn):
+        conn.settimeout(1)
+        try:
+            line = conn.makefile('rb').readline()
+            request = json.loads(line)
+            handler = self.commands.get(request.get('cmd'))
+            if handler is None:
+                response = { 'error': f'unknown command: {request.get("cmd")}' }
+            else:
+                response = handler(conn, request)
+                if response is None:
+                    return
+            conn.sendall(json.dumps(response).encode() + b'\n')
+        except Exception as e:
+            logging.debug(f'control: {e}')
+        conn.close()
+
+    def run(self, finish):
+        try:
+            while not finish.is_set():
+                readable, _, _ = select.select([self.sock], [], [], 1)
+                if readable:
+                    conn, _ = self.sock.accept()
+                    self._handle(conn)
+        finally:
+            with self.lock:
+                for conn in self.watchers:
+                    conn.close()
+                self.watchers.clear()
+            self.sock.close()
+            os.unlink(self.path)
+
+# send one request, yields the response lines until the daemon closes
+def request(path, cmd, **kwargs):
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(str(path))
+        sock.sendall(json.dumps(dict(kwargs, cmd=cmd)).encode() + b'\n')
+        for line in sock.makefile('rb'):
+            yield json.loads(line)
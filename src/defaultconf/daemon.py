@@ -1,24 +1,45 @@
 #!/usr/bin/env python3
 
 import functools
+import json
 import os
 import logging
+import time
 import signal
 import threading
 import concurrent.futures
 import socket
-import ipaddress
 
 from . import bsdnetlink
 from .common import *
+from .prober import Prober, Target, SO_SETFIB, sockaddr
+from .metrics import Measurements
+from .dampening import Dampener
+from .timers import Timers
+from .ra import RAListener
+from .lease import LeaseWatcher
+from .publish import Publisher
+from .control import ControlServer
+from .netaddr import addr_width
 
+default_afs = (socket.AF_INET, socket.AF_INET6)
+
+# config fields a reload applies, the rest are bound to the sockets, tables and
+#   threads set up at start and need a restart
+reloadable_fields = ('priority', 'neigh_check', 'neigh_prewarm')
+
+# releases coalesce, the afs they name add up until taken, no afs means all of them
 class Trigger:
 
     def __init__(self):
         self.s = threading.BoundedSemaphore(1)
         self.acquire()
+        self.lock = threading.Lock()
+        self.pending = set()
 
-    def release(self):
+    def release(self, *afs):
+        with self.lock:
+            self.pending.update(afs or default_afs)
         try:
             self.s.release()
         except ValueError:
@@ -27,71 +48,274 @@ class Trigger:
     def acquire(self, blocking=True, timeout=None):
         return self.s.acquire(blocking=blocking, timeout=timeout)
 
+    def take(self):
+        with self.lock:
+            pending, self.pending = self.pending, set()
+            return pending
+
 # test the presented default
-#   1) is the link up?
-#   2) is there a link address to support it?
-#   3) is there a route to support it?
-def default_test(nettables, default):
+#   1) is the link up, running and does it have carrier?
+#   2) optionally, has neighbor resolution for it not failed?
+#   3) optionally, does it answer probes?
+#   4) is there a link address to support it?
+#   5) is there a route to support it?
+def default_test(nettables, default, *, neigh_check=False, prober=None):
+    return default_test_reason(nettables, default, neigh_check=neigh_check, prober=prober) is None
+
+# same as default_test, returns why the default fails or None if it passes
+def default_test_reason(nettables, default, *, neigh_check=False, prober=None):
     # filter links to link name
     try:
         link, = nettables.get_links(lambda e: e.name == default.link)
     except ValueError:
         # catch too few and too many,
         # TODO too many should never happen, consider throwing
-        return False
+        return 'link missing'
 
-    # skip if link isn't up
-    if not link.up:
-        return False
+    # skip if link isn't up, or lost carrier with the admin state still up
+    if not link.live:
+        return 'link down'
 
-    # filter until you find an addr that works
-    linkaddrs = nettables.get_addrs(lambda e: e.link_index == link.index)
-    for addr in linkaddrs:
-        if default.addr in addr.address.network:
-            return True
+    # skip if arp/ndp gave up on it, no entry at all is fine
+    if neigh_check:
+        neigh = nettables.get_neigh(default.af, link.index, default.addr)
+        if neigh is not None and neigh.failed:
+            return 'neighbor unreachable'
 
-    # filter all routes as next hops that support our case
+    # skip if it stopped answering
+    if prober is not None and not prober.is_alive(default.af, default.link, default.addr):
+        return 'gateway not answering'
+
+    # is there an addr on the link whose network supports it
+    if nettables.addr_covers(default.af, link.index, default.addr):
+        return None
+
+    # is there a route out the link that supports it
     # TODO the hops could be across ifs right?
-    linkroutes = nettables.get_routes(lambda e: e.link_index == link.index)
-    for route in linkroutes:
-        if default.addr in route.dst:
-            return True
+    if nettables.route_covers(default.af, link.index, default.addr):
+        return None
+
+    return 'no route'
+
+# narrow netlink events down to what the gateways in state could ever depend on,
+#   disabled gateways are kept in so that enabling one doesn't need a resync
+def compile_nl_filter(config, state, nettables):
+    links = { e.name: e.index for e in nettables.get_links(lambda e: True) }
+    afs = set()
+    ifs = set()
+    prefixes = set()
+    for gateway in state.gateways:
+        afs.add(gateway.af)
+        index = links.get(gateway.link)
+        if index is not None:
+            ifs.add(index)
+        prefixes.add((gateway.af, gateway.addr, addr_width(gateway.af)))
+    return bsdnetlink.NLFilterSpec(config.fib, frozenset(afs), frozenset(ifs), frozenset(prefixes))
+
+# every enabled gateway whose link exists gets probed, not only the active one,
+#   the standby has to be known good before we switch to it
+def probe_targets(defaultconf, nettables):
+    targets = []
+    for af in (socket.AF_INET, socket.AF_INET6):
+        for gateway in defaultconf.get_defaults(GatewaySelect(af=af)):
+            link_index = nettables.get_link_index(gateway.link)
+            if link_index is not None:
+                targets.append(Target(gateway.af, gateway.link, gateway.addr, link_index))
+    return targets
+
+# get the kernel to resolve addr, any datagram will do, the discard port is as good as any
+def kick_neigh(fib, af, addr, link_index):
+    with socket.socket(af, socket.SOCK_DGRAM) as sock:
+        if fib:
+            sock.setsockopt(socket.SOL_SOCKET, SO_SETFIB, fib)
+        try:
+            sock.sendto(b'', sockaddr(af, addr, 9, link_index))
+        except OSError as e:
+            logging.debug(f'neighbor kick failed: {e}')
+
+# resolve the incoming gateway before the default points at it, otherwise the
+#   first packets queue behind arp/nd and get dropped once the hold queue fills
+def prewarm_neigh(nettables, fib, af, addr, link_index, timeout):
+    if nettables.wait_neigh_ready(af, link_index, addr, 0):
+        return True
+    kick_neigh(fib, af, addr, link_index)
+    ready = nettables.wait_neigh_ready(af, link_index, addr, timeout)
+    if not ready:
+        logging.debug(f'neighbor {to_ip_address(af, addr)} not ready after {timeout}s, switching anyway')
+    return ready
+
+# a ready to send message that makes gateway the default, see Failover
+class Standby(namedtuple('Standby', ['gateway', 'link_index', 'fib', 'hdr'])):
+
+    def send(self, snl):
+        # the sequence number is the only part that changes between sends
+        self.hdr.nlmsg_seq = snl.get_seq()
+        snl.send_message(self.hdr)
+        snl.read_reply_code(self.hdr.nlmsg_seq)
 
-    return False
+# NOTE
+#   After every harmonize the next best valid gateway on another link than the
+#   active one is kept per af, along with a prebuilt RTM_NEWROUTE/NLM_F_REPLACE
+#   for it.  Switching to it is then a single send, no selection or encoding.
+class Failover:
 
-def harmonize_default(defaultconf, nettables, snl, fib, af, af_default_dst):
+    def __init__(self):
+        self.lock = threading.RLock()
+        self.active = {}
+        self.standby = {}
+
+    def prepare(self, snl, fib, af, active, active_link_index, standby, standby_link_index):
+        with self.lock:
+            self.active[af] = None if active is None else (active, active_link_index)
+            if standby is None or standby_link_index is None:
+                self.standby.pop(af, None)
+                return
+            current = self.standby.get(af)
+            if current is not None:
+                if (current.gateway, current.link_index, current.fib) == (standby, standby_link_index, fib):
+                    return
+            flags = bsdnetlink.NLM_F_CREATE | bsdnetlink.NLM_F_REPLACE
+            hdr = bsdnetlink.build_route_msg(snl, fib, bsdnetlink.RTM_NEWROUTE, flags,
+                    af, 0, 0, standby.addr, standby_link_index)
+            self.standby[af] = Standby(standby, standby_link_index, fib, hdr)
+
+    def get_active(self, af):
+        with self.lock:
+            return self.active.get(af)
+
+    def get_standby(self, af):
+        with self.lock:
+            return self.standby.get(af)
+
+    # returns the gateway switched to, or None if there was no standby
+    def switch(self, snl, af):
+        with self.lock:
+            standby = self.standby.pop(af, None)
+            if standby is None:
+                return None
+            standby.send(snl)
+            self.active[af] = (standby.gateway, standby.link_index)
+            return standby.gateway
+
+# the default is 0/0 in either af
+def harmonize_default(defaultconf, nettables, snl, fib, af, failover, prober=None, measurements=None,
+        dampener=None):
+    # prewarm outside of the failover lock, the fast path must not wait on arp/nd
+    #   NOTE this guesses the selection without the dampener, at worst a suppressed
+    #   gateway gets resolved for nothing
+    prewarm = defaultconf.config.neigh_prewarm
+    if prewarm:
+        pdefault_test = functools.partial(default_test, nettables, neigh_check=defaultconf.config.neigh_check,
+                prober=prober)
+        default = next(filter(pdefault_test, defaultconf.get_defaults(GatewaySelect(af=af))), None)
+        current_default = nettables.get_route(af, 0, 0)
+        if default is not None and (current_default is None or current_default.gw != default.addr):
+            link_index = nettables.get_link_index(default.link)
+            if link_index is not None:
+                prewarm_neigh(nettables, fib, af, default.addr, link_index, prewarm)
+
+    # the fast path programs routes too, don't interleave with it
+    with failover.lock:
+        _harmonize_default(defaultconf, nettables, snl, fib, af, failover, prober, dampener)
+        if measurements is not None:
+            active = failover.get_active(af)
+            measurements.set_active(af, None if active is None else active[0])
+        standby = failover.get_standby(af)
+
+    # the standby is switched to without any wait, keep its neighbor entry warm
+    if prewarm and standby is not None:
+        neigh = nettables.get_neigh(af, standby.link_index, standby.gateway.addr)
+        if neigh is None or not neigh.ready:
+            kick_neigh(fib, af, standby.gateway.addr, standby.link_index)
+
+def _harmonize_default(defaultconf, nettables, snl, fib, af, failover, prober, dampener):
     defaults = defaultconf.get_defaults(GatewaySelect(af=af))
-    pdefault_test = functools.partial(default_test, nettables)
-    default = next(iter(filter(pdefault_test, defaults)), None)
+    pdefault_test = functools.partial(default_test, nettables, neigh_check=defaultconf.config.neigh_check,
+            prober=prober)
+    if dampener is None:
+        valid = list(filter(pdefault_test, defaults))
+    else:
+        # every gateway is tested so that the dampener sees each transition
+        valid = [ e for e in defaults if dampener.observe(e, pdefault_test(e)) ]
+    default = next(iter(valid), None)
     link_index = None if default is None else bsdnetlink.if_nametoindex(snl, default.link)
-    current_default = None
-    try:
-        current_default, = nettables.get_routes(lambda r: r.dst == af_default_dst)
-    except ValueError:
-        # too few or too many
-        # TODO throw on too many?
-        pass
+    current_default = nettables.get_route(af, 0, 0)
     if default is None:
         if current_default is None:
             logging.debug("default==null, current_default==null, NOOP")
         else:
             logging.debug("default==null, current_default!=null, DELETE")
-            bsdnetlink.delete_route(snl, fib, current_default.dst, current_default.gw, current_default.link_index)
+            bsdnetlink.delete_route(snl, fib, af, current_default.dst, current_default.dst_len, current_default.gw, current_default.link_index)
+            nettables.invalidate_lookups()
     else:
         if current_default is None:
             logging.debug("default!=null, current_default!=null, SET")
-            bsdnetlink.new_route(snl, fib, af_default_dst, default.addr, link_index)
+            bsdnetlink.new_route(snl, fib, af, 0, 0, default.addr, link_index)
+            nettables.invalidate_lookups()
         else:
             if current_default.gw == default.addr:
                 logging.debug("default!=null, current_default!=null, default==current_default, NOOP")
             else:
-                logging.debug("default!=null, current_default!=null, default!=current_default, UPDATE")
-                bsdnetlink.delete_route(snl, fib, current_default.dst, current_default.gw, current_default.link_index)
-                bsdnetlink.new_route(snl, fib, af_default_dst, default.addr, link_index)
+                standby = failover.get_standby(af)
+                if standby is not None and (standby.gateway, standby.link_index, standby.fib) == (default, link_index, fib):
+                    logging.debug("default!=null, current_default!=null, default!=current_default, default==standby, SWITCH")
+                    failover.switch(snl, af)
+                else:
+                    logging.debug("default!=null, current_default!=null, default!=current_default, UPDATE")
+                    bsdnetlink.delete_route(snl, fib, af, current_default.dst, current_default.dst_len, current_default.gw, current_default.link_index)
+                    bsdnetlink.new_route(snl, fib, af, 0, 0, default.addr, link_index)
+                nettables.invalidate_lookups()
 
-def daemon(config):
+    # precompute the switch to the next best gateway, preferably one that doesn't
+    #   share the link, another router on the same link still covers a dead gateway
+    standby = None
+    if default is not None:
+        standby = next(iter(filter(lambda e: e.link != default.link, valid[1:])), None)
+        if standby is None:
+            standby = next(iter(valid[1:]), None)
+    standby_link_index = None if standby is None else nettables.get_link_index(standby.link)
+    failover.prepare(snl, fib, af, default, link_index, standby, standby_link_index)
+
+def same_gateway(a, b):
+    if a is None or b is None:
+        return a is b
+    return (a.af, a.link, a.addr) == (b.af, b.link, b.addr)
+
+# why harmonize moved off previous, for the watchers
+def explain_switch(defaultconf, nettables, af, previous, prober, dampener):
+    if previous is None:
+        return 'gateway added'
+    state = defaultconf.state
+    if not any(same_gateway(e, previous) for e in state.gateways):
+        return 'gateway removed'
+    if not any(same_gateway(e, previous) for e in defaultconf.get_defaults(GatewaySelect(af=af))):
+        return 'gateway disabled or expired'
+    reason = default_test_reason(nettables, previous, neigh_check=defaultconf.config.neigh_check, prober=prober)
+    if reason is not None:
+        return reason
+    if dampener is not None and dampener.suppressed(previous):
+        return 'gateway dampened'
+    return 'priority change'
+
+# only what the daemon measures, written when it changes
+def write_stats(path, stats):
+    data = json.dumps(stats, sort_keys=True)
+    try:
+        if path.read_text() == data:
+            return
+    except FileNotFoundError:
+        pass
+    tmp = path.with_name(f'{path.name}.tmp')
+    tmp.write_text(data)
+    os.replace(tmp, path)
+
+def daemon(config, config_path=default_config_path):
     config.pid_path.write_text(str(os.getpid()))
-    defaultconf = DefaultConf(config)
+    if config.sort_strategy == 'performance' and config.probe is None:
+        raise Exception('the performance sort strategy needs probe to be configured')
+    measurements = None if config.probe is None else Measurements()
+    defaultconf = DefaultConf(config, measurements=measurements)
+    dampener = None if config.dampening is None else Dampener(config.dampening)
 
     # triggered to quit daemon
     finish_ev = threading.Event()
@@ -115,34 +339,237 @@ def daemon(config):
         state_reload_ev.release()
     signal.signal(signal.SIGUSR1, sigusr1_handler)
 
-    # wait for a signal to reload the state file
+    # handler for signals that trigger config reload
+    config_reload_ev = Trigger()
+    def sighup_handler(*_):
+        config_reload_ev.release()
+    signal.signal(signal.SIGHUP, sighup_handler)
+
+    # deadlines, gateway expiry and dampening reuse
+    timers = Timers()
+    tasks.append(executor.submit(timers.run, finish_ev))
+
+    # a gateway past its lifetime drops out of get_defaults, all that's needed is
+    #   harmonizing its af right then
+    #   a re-registered gateway is both removed and added, cancel before setting
+    def schedule_expiry(added, removed=()):
+        for gateway in removed:
+            if gateway.expires is not None:
+                timers.cancel(('expires', gateway.af, gateway.link, gateway.protocol, gateway.addr))
+        for gateway in added:
+            if gateway.expires is None:
+                continue
+            key = ('expires', gateway.af, gateway.link, gateway.protocol, gateway.addr)
+            timers.set(key, gateway.expires, functools.partial(trigger_ev.release, gateway.af))
+    schedule_expiry(defaultconf.state.gateways)
+
+    # wait for a signal to reload the state file, only the afs the diff touches
+    #   are harmonized
     def state_reload_handler():
         while not finish_ev.is_set():
             if not state_reload_ev.acquire(timeout=1):
                 continue
-            defaultconf.reload_state()
-            trigger_ev.release()
+            diff = defaultconf.reload_state()
+            schedule_expiry(diff.added, diff.removed)
+            afs = diff.afs()
+            if not afs:
+                logging.debug('state reloaded, no change')
+                continue
+            trigger_ev.release(*afs)
     tasks.append(executor.submit(state_reload_handler))
 
-    nettables = bsdnetlink.NetTables()
-    tasks.append(executor.submit(bsdnetlink.maintain_nettables, finish_ev, trigger_ev, nettables))
+    # reread the config file, the new priority list takes effect on the next harmonize
+    #   returns the fields applied and the ones left for a restart
+    config_lock = threading.Lock()
+    def reload_config():
+        with config_lock:
+            current = defaultconf.config
+            new = Config.from_path(config_path)
+            changed = [ e for e in Config._fields if getattr(new, e) != getattr(current, e) ]
+            applied = [ e for e in changed if e in reloadable_fields ]
+            ignored = [ e for e in changed if e not in reloadable_fields ]
+            if ignored:
+                logging.warning(f'config reload: {", ".join(ignored)} need a restart')
+            if applied:
+                logging.info(f'config reload: {", ".join(applied)}')
+                defaultconf.set_config(current._replace(**{ e: getattr(new, e) for e in applied }))
+                trigger_ev.release()
+            return applied, ignored
+
+    def config_reload_handler():
+        while not finish_ev.is_set():
+            if not config_reload_ev.acquire(timeout=1):
+                continue
+            try:
+                reload_config()
+            except Exception as e:
+                logging.error(f'config reload: {e}')
+    tasks.append(executor.submit(config_reload_handler))
+
+    # router advertisements register inet6 gateways like any hook would
+    if config.ra is not None:
+        def ra_change_handler(link, group):
+            logging.info(f'ra routers on {link}: {len(group)}')
+            with State.update(config) as state:
+                if group:
+                    addrs, lifetimes = zip(*group)
+                    state.add(socket.AF_INET6, link, 'ra', list(addrs), lifetime=list(lifetimes))
+                else:
+                    state.remove(GatewaySelect(socket.AF_INET6, link, 'ra'))
+        tasks.append(executor.submit(RAListener(config.ra).run, finish_ev, ra_change_handler))
+
+    # dhclient lease files instead of the enter hook, only a changed router set is written
+    if config.dhcp_leases is not None:
+        known = {}
+        for gateway in sorted(defaultconf.state.gateways, key=lambda e: e.rank):
+            if gateway.af == socket.AF_INET and gateway.protocol == 'dhcp':
+                known[gateway.link] = known.get(gateway.link, ()) + (gateway.addr,)
+        def lease_change_handler(link, routers):
+            with State.update(config) as state:
+                if routers:
+                    state.add(socket.AF_INET, link, 'dhcp', routers)
+                else:
+                    state.remove(GatewaySelect(socket.AF_INET, link, 'dhcp'))
+        lease_watcher = LeaseWatcher(config.dhcp_leases, lease_change_handler, timers=timers, known=known)
+        tasks.append(executor.submit(lease_watcher.run, finish_ev))
+
+    nettables = bsdnetlink.NetTables(fib=config.fib, mirror_routes=config.mirror_routes)
+    failover = Failover()
+
+    # what get-default reads, published under the failover lock so a fast switch
+    #   and a harmonize can't publish out of order
+    publisher = Publisher(config.decision_path)
+    # watchers get pushed every change, along with the reason
+    control = ControlServer(config.control_path)
+    def reload_config_command(conn, request):
+        try:
+            applied, ignored = reload_config()
+        except Exception as e:
+            return { 'error': str(e) }
+        return { 'applied': applied, 'restart': ignored }
+    control.register('reload-config', reload_config_command)
+    tasks.append(executor.submit(control.run, finish_ev))
+    def publish(af, previous=None, reason=None):
+        with failover.lock:
+            active = failover.get_active(af)
+            current = None if active is None else active[0]
+            publisher.publish(af, current)
+            if reason is None or same_gateway(previous, current):
+                return
+            control.notify({
+                'ts': time.time(),
+                'af': af.name,
+                'default': None if current is None else current.to_data(),
+                'previous': None if previous is None else previous.to_data(),
+                'reason': reason,
+            })
+
+    # fast path, if the link under an active default goes down switch straight
+    #   to the prepared standby, full reconciliation follows via the trigger
+    fast_snl = bsdnetlink.SNL(bsdnetlink.NETLINK_ROUTE, read_timeout=1)
+    fast_lock = threading.Lock()
+    def fast_switch(af, reason):
+        with fast_lock:
+            previous = failover.get_active(af)
+            gateway = failover.switch(fast_snl, af)
+        if gateway is None:
+            return
+        previous = None if previous is None else previous[0]
+        publish(af, previous, reason)
+        # the watch stream has the previous default on its own, the log names it here
+        failed = '' if previous is None else f' on {previous.link}'
+        logging.info(f'{reason}{failed}, switched {af.name} default to {gateway.link}')
+        # reflect the switch right away, the kernel's events are still queued
+        nettables.new_route(bsdnetlink.Route(af, 0, 0, gateway.addr, failover.get_active(af)[1]), replace=True)
+        nettables.invalidate_lookups()
+
+    def link_down_handler(link):
+        for af in default_afs:
+            active = failover.get_active(af)
+            if active is None or active[1] != link.index:
+                continue
+            # a standby on the same link went down with it
+            standby = failover.get_standby(af)
+            if standby is None or standby.link_index == link.index:
+                continue
+            fast_switch(af, 'link down')
+        trigger_ev.release()
+    tasks.append(executor.submit(bsdnetlink.maintain_nettables, finish_ev, trigger_ev, nettables,
+            link_down=link_down_handler))
+
+    # active probing of the candidates, a dead active default takes the fast path too
+    prober = None
+    if config.probe is not None:
+        def probe_change_handler(target, alive):
+            active = failover.get_active(target.af)
+            if not alive and active is not None:
+                gateway, link_index = active
+                if (gateway.link, gateway.addr, link_index) == (target.link, target.addr, target.link_index):
+                    fast_switch(target.af, 'gateway not answering')
+            trigger_ev.release(target.af)
+        # rerank at most every rerank_interval, harmonize is a noop while the order holds
+        rerank_interval = config.probe.interval * config.probe.window
+        rerank_last = [0.0]
+        def probe_sample_handler(target, sample):
+            measurements.update(target.af, target.link, target.addr, sample.rtt)
+            if config.sort_strategy == 'performance' and sample.ts - rerank_last[0] >= rerank_interval:
+                rerank_last[0] = sample.ts
+                trigger_ev.release(target.af)
+        prober = Prober(config.probe, fib=config.fib, on_change=probe_change_handler,
+                on_sample=probe_sample_handler)
+        tasks.append(executor.submit(prober.run, finish_ev))
 
     # wait for update events, evaulate the tables, possibly act
-    inet4_default_dst = ipaddress.ip_network('0.0.0.0/0')
-    inet6_default_dst = ipaddress.ip_network('::/0')
     def monitor():
         snl = bsdnetlink.SNL(bsdnetlink.NETLINK_ROUTE, read_timeout=1)
         while not finish_ev.is_set():
             if not trigger_ev.acquire(timeout=1):
                 continue
-            logging.debug("triggered")
+            afs = trigger_ev.take()
+            logging.debug(f"triggered {' '.join(af.name for af in sorted(afs))}")
             fib = config.fib
             try:
-                harmonize_default(defaultconf, nettables, snl, fib, socket.AF_INET, inet4_default_dst)
+                spec = compile_nl_filter(config, defaultconf.state, nettables)
+                if nettables.set_filter(spec):
+                    logging.debug("netlink filter changed, resyncing")
+                    bsdnetlink.resync_nettables(nettables, snl)
+                if prober is not None:
+                    targets = probe_targets(defaultconf, nettables)
+                    prober.set_targets(targets)
+                    measurements.retain((e.af, e.link, e.addr) for e in targets)
             except Exception as e:
                 logging.error(e)
+            for af in default_afs:
+                if af not in afs:
+                    continue
+                try:
+                    previous = failover.get_active(af)
+                    previous = None if previous is None else previous[0]
+                    harmonize_default(defaultconf, nettables, snl, fib, af, failover, prober, measurements,
+                            dampener)
+                    current = failover.get_active(af)
+                    current = None if current is None else current[0]
+                    reason = None
+                    if not same_gateway(previous, current):
+                        reason = explain_switch(defaultconf, nettables, af, previous, prober, dampener)
+                    publish(af, previous, reason)
+                except Exception as e:
+                    logging.error(e)
             try:
-                harmonize_default(defaultconf, nettables, snl, fib, socket.AF_INET6, inet6_default_dst)
+                if dampener is not None:
+                    dampener.retain((e.af, e.link, e.addr) for e in defaultconf.state.gateways)
+                    # a suppressed gateway that decays below reuse is a trigger of its own
+                    reuse = dampener.next_reuse()
+                    if reuse is None:
+                        timers.cancel(('reuse',))
+                    else:
+                        timers.set(('reuse',), time.time() + reuse - time.monotonic(), trigger_ev.release)
+                stats = {}
+                if dampener is not None:
+                    stats['dampening'] = dampener.to_data()
+                if measurements is not None:
+                    stats['paths'] = measurements.to_data()
+                write_stats(config.stats_path, stats)
             except Exception as e:
                 logging.error(e)
 
@@ -154,4 +581,5 @@ def daemon(config):
             task.result()
     finally:
         finish_ev.set()
+        publisher.unlink()
 
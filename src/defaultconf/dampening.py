@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+
+import math
+import socket
+import threading
+import time
+from collections import namedtuple
+
+from .netaddr import *
+
+# NOTE
+#   bgp style flap dampening (rfc 2439) per gateway.  Every time a gateway goes
+#   from valid to invalid it collects `penalty`, the penalty halves every
+#   `half_life` seconds.  Above `suppress` the gateway is held out of selection
+#   until it decayed below `reuse`.  `max_suppress` caps how long that can take.
+#
+#   A hook removing the gateway (ppp linkdown, dhcp expiry) is a flap just the
+#   same, a usable gateway disappearing from state collects the penalty.  Its
+#   record is kept while gone, so the re-add starts out with the history, and
+#   is only forgotten once it decayed to nothing.
+
+class DampeningConfig(namedtuple('DampeningConfig', ['penalty', 'half_life', 'suppress', 'reuse', 'max_suppress'],
+            defaults=[1000, 60, 2000, 750, 600])):
+
+    @staticmethod
+    def from_data(data):
+        dampening = DampeningConfig(**data)
+        if not 0 < dampening.reuse < dampening.suppress:
+            raise Exception('dampening reuse must be below suppress')
+        return dampening
+
+    # the penalty that takes max_suppress to decay to reuse
+    def ceiling(self):
+        return self.reuse * 2 ** (self.max_suppress / self.half_life)
+
+class Flap(namedtuple('Flap', ['penalty', 'ts', 'valid', 'suppressed', 'flaps'])):
+    pass
+
+class Dampener:
+
+    def __init__(self, dampening):
+        self.dampening = dampening
+        self.lock = threading.Lock()
+        self.flaps = {}
+
+    def _decayed(self, flap, now):
+        return flap.penalty * 2 ** (-(now - flap.ts) / self.dampening.half_life)
+
+    def _current(self, key, now):
+        flap = self.flaps.get(key)
+        if flap is None:
+            return None
+        penalty = self._decayed(flap, now)
+        suppressed = flap.suppressed and penalty >= self.dampening.reuse
+        flap = flap._replace(penalty=penalty, ts=now, suppressed=suppressed)
+        self.flaps[key] = flap
+        return flap
+
+    # valid to invalid, flap is current
+    def _flap(self, flap):
+        penalty = min(flap.penalty + self.dampening.penalty, self.dampening.ceiling())
+        suppressed = flap.suppressed or penalty >= self.dampening.suppress
+        return flap._replace(penalty=penalty, suppressed=suppressed, flaps=flap.flaps + 1, valid=False)
+
+    # feed the outcome of default_test, returns whether the gateway is usable
+    def observe(self, gateway, valid, now=None):
+        now = time.monotonic() if now is None else now
+        key = (gateway.af, gateway.link, gateway.addr)
+        with self.lock:
+            flap = self._current(key, now)
+            if flap is None:
+                flap = Flap(0.0, now, valid, False, 0)
+            if flap.valid and not valid:
+                flap = self._flap(flap)
+            flap = flap._replace(valid=valid)
+            self.flaps[key] = flap
+            return valid and not flap.suppressed
+
+    def suppressed(self, gateway, now=None):
+        now = time.monotonic() if now is None else now
+        with self.lock:
+            flap = self._current((gateway.af, gateway.link, gateway.addr), now)
+            return flap is not None and flap.suppressed
+
+    # keys are the gateways in state, one that was usable and is gone flapped,
+    #   see NOTE, gone ones are forgotten once their history decayed to nothing.
+    #   every record is decayed, observe only sees the gateways get_defaults
+    #   returns and a disabled or expired one would stay suppressed otherwise
+    def retain(self, keys, now=None):
+        now = time.monotonic() if now is None else now
+        keys = set(keys)
+        with self.lock:
+            for key in list(self.flaps):
+                flap = self._current(key, now)
+                if key in keys:
+                    continue
+                if flap.valid:
+                    flap = self._flap(flap)
+                    self.flaps[key] = flap
+                if not flap.suppressed and flap.penalty < 1:
+                    del self.flaps[key]
+
+    # monotonic time the next suppressed gateway becomes usable again, or None
+    def next_reuse(self, now=None):
+        now = time.monotonic() if now is None else now
+        with self.lock:
+            reuse = None
+            for key in list(self.flaps):
+                # decayed below reuse is no longer suppressed, its time is past
+                flap = self._current(key, now)
+                if not flap.suppressed:
+                    continue
+                t = flap.ts + self.dampening.half_life * math.log2(flap.penalty / self.dampening.reuse)
+                reuse = t if reuse is None else min(reuse, t)
+            return reuse
+
+    def to_data(self, now=None):
+        now = time.monotonic() if now is None else now
+        with self.lock:
+            data = []
+            for (af, link, addr), flap in self.flaps.items():
+                data.append({
+                    'af': socket.AddressFamily(af).name,
+                    'link': link,
+                    'addr': str(to_ip_address(af, addr)),
+                    'penalty': round(self._decayed(flap, now)),
+                    'suppressed': flap.suppressed,
+                    'flaps': flap.flaps,
+                })
+            return data
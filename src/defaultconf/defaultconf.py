@@ -1,8 +1,9 @@
 #!/usr/bin/env python3
 
+import sys
 import socket
 import argparse
-import ipaddress
+import functools
 import json
 from pathlib import Path
 
@@ -21,7 +22,18 @@ def parse_af(af):
         return socket.AF_INET6
     raise Exception(f'unknown af: {af}')
 
-def main():
+# the daemon's published defaults, None if it isn't running
+def read_published(config):
+    from .publish import read_decision
+    defaults = read_decision(config.decision_path)
+    if defaults is None:
+        return None
+    return { af: None if e is None else Gateway(*e) for af, e in defaults.items() }
+
+# the actions that change state, these can be batched with apply
+state_actions = {'add', 'remove', 'enable', 'disable'}
+
+def build_parser():
     parser = argparse.ArgumentParser()
     parser.add_argument('-c', metavar='config-path', type=Path, default=default_config_path)
     parser.add_argument('-d', action='store_true')
@@ -30,7 +42,8 @@ def main():
     subparser.add_argument('-f', metavar='address-family', required=True)
     subparser.add_argument('-l', metavar='link', required=True)
     subparser.add_argument('-p', metavar='protocol', required=True)
-    subparser.add_argument('addr', metavar='address')
+    subparser.add_argument('-t', metavar='lifetime', type=float)
+    subparser.add_argument('addr', metavar='address', nargs='+')
     subparser = subparsers.add_parser('remove')
     subparser.add_argument('-f', metavar='address-family')
     subparser.add_argument('-l', metavar='link')
@@ -49,47 +62,128 @@ def main():
     subparser.add_argument('-p', metavar='protocol')
     subparser = subparsers.add_parser('daemon')
     subparser = subparsers.add_parser('signal-daemon')
+    subparser = subparsers.add_parser('stats')
+    subparser = subparsers.add_parser('watch')
+    subparser = subparsers.add_parser('reload-config')
+    subparser = subparsers.add_parser('apply')
+    subparser.add_argument('path', metavar='operations-path', nargs='?', type=Path)
+    return parser
+
+# validate a state action, returns the function that applies it to a State
+def state_operation(args):
+    if args.action == 'add':
+        validate_protocol(args.p)
+        af = parse_af(args.f)    
+        addrs = []
+        for e in args.addr:
+            addr_af, addr = parse_ip_address(e)
+            if addr_af != af:
+                raise Exception(f'address family mismatch: {e}')
+            addrs.append(addr)
+        return lambda state: state.add(af, args.l, args.p, addrs, lifetime=args.t)
+    af = None if args.f is None else parse_af(args.f)
+    select = GatewaySelect(af, args.l, args.p)
+    if args.action == 'remove':
+        # a bare remove would match every gateway and wipe the state
+        if select == GatewaySelect(None, None, None):
+            raise Exception('remove needs at least one of -f, -l, -p')
+        return lambda state: state.remove(select)
+    elif args.action == 'enable':
+        return lambda state: state.enable(select)
+    elif args.action == 'disable':
+        return lambda state: state.disable(select)
+    raise Exception(f'not a state action: {args.action}')
+
+# one operation per line, the same as on the command line, # comments
+#   everything is validated before anything is applied
+def read_operations(parser, lines):
+    import shlex
+    operations = []
+    for n, line in enumerate(lines, 1):
+        words = shlex.split(line, comments=True)
+        if not words:
+            continue
+        try:
+            args = parser.parse_args(words)
+        except SystemExit:
+            raise Exception(f'line {n}: invalid operation: {line.strip()}')
+        if args.action not in state_actions:
+            raise Exception(f'line {n}: {args.action} can not be applied')
+        try:
+            operations.append(state_operation(args))
+        except Exception as e:
+            raise Exception(f'line {n}: {e}')
+    return operations
+
+def main():
+    parser = build_parser()
     args = parser.parse_args()
 
-    if args.d:
-        logging.basicConfig(level=logging.DEBUG)
-    else:
-        logging.basicConfig(level=logging.INFO)
+    set_log_level('DEBUG' if args.d else 'INFO')
+    # hook runs log only when something goes wrong, everything else sets it up now
+    if args.action not in state_actions and args.action != 'apply':
+        get_logging()
 
-    config = Config.from_path(args.c)
+    # NOTE
+    #   Parsed on first use, after the arguments checked out, and from the json
+    #   cache unless the file changed, see read_config_data.  Every subcommand
+    #   imports what only it needs itself, a hook run shouldn't pay for the
+    #   daemon or the control socket.
+    @functools.lru_cache(maxsize=None)
+    def get_config():
+        return Config.from_path(args.c)
 
     if args.action is None:
         raise Exception('action not specified')
     elif args.action == 'daemon':
         from . import daemon
-        daemon.daemon(config)
+        daemon.daemon(get_config(), args.c)
     elif args.action == 'signal-daemon':
-        try_signal_daemon(config, ignore_failure=False)
-    elif args.action == 'add':
-        validate_protocol(args.p)
-        af = parse_af(args.f)    
-        addr = ipaddress.ip_address(args.addr)
-        with State.update(config) as state:
-            state.add(af, args.l, args.p, addr)
-    elif args.action == 'remove':
-        af = parse_af(args.f)
-        with State.update(config) as state:
-            state.remove(GatewaySelect(af, args.l, args.p))
+        try_signal_daemon(get_config(), ignore_failure=False)
+    elif args.action == 'watch':
+        from . import control
+        try:
+            for event in control.request(get_config().control_path, 'watch'):
+                print(json.dumps(event), flush=True)
+        except KeyboardInterrupt:
+            pass
+    elif args.action == 'reload-config':
+        from . import control
+        for response in control.request(get_config().control_path, 'reload-config'):
+            print(json.dumps(response))
+            if 'error' in response:
+                raise Exception(response['error'])
+    elif args.action == 'stats':
+        stats_path = get_config().stats_path
+        if stats_path.exists():
+            print(stats_path.read_text())
+    elif args.action in state_actions:
+        operation = state_operation(args)
+        with State.update(get_config()) as state:
+            operation(state)
+    elif args.action == 'apply':
+        # one transaction, one journal record and one signal for the lot
+        if args.path is None or str(args.path) == '-':
+            operations = read_operations(parser, sys.stdin)
+        else:
+            with args.path.open() as f:
+                operations = read_operations(parser, f)
+        with State.update(get_config()) as state:
+            for operation in operations:
+                operation(state)
     elif args.action == 'get-default':
         af = None if args.f is None else parse_af(args.f)
-        default_conf = DefaultConf(config)
         select = GatewaySelect(af, args.l, args.p)
-        default = next(iter(default_conf.get_defaults(select)), None)
+        # what the daemon installed, computing is left for selects it doesn't publish
+        published = None if args.l is not None or args.p is not None else read_published(get_config())
+        if published is not None:
+            defaults = [ published[e] for e in (socket.AF_INET, socket.AF_INET6) if af in (None, e) ]
+            default = next(filter(None, defaults), None)
+        else:
+            default_conf = DefaultConf(get_config())
+            default = next(iter(default_conf.get_defaults(select)), None)
         if default is not None:
             print(json.dumps(default.to_data()))
-    elif args.action == 'enable':
-        af = None if args.f is None else parse_af(args.f)
-        with State.update(config) as state:
-            state.enable(GatewaySelect(af, args.l, args.p))
-    elif args.action == 'disable':
-        af = None if args.f is None else parse_af(args.f)
-        with State.update(config) as state:
-            state.disable(GatewaySelect(af, args.l, args.p))
     else:
         raise Exception(f'unknown action: {args.action}')
 
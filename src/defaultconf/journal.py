@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+
+import contextlib
+import fcntl
+import json
+import os
+
+# NOTE
+#   State persistence is a snapshot plus an append-only journal next to it,
+#   {state_path}.journal.  Every State.update is one journal line,
+#   { gen, ops }, written with a single write so a crash leaves at most one
+#   torn last line, which replay ignores.  The snapshot records the gen it
+#   includes, journal lines at or below it are leftovers of a compaction that
+#   didn't get to truncate the journal, and are skipped.
+#
+#   The snapshot is replaced atomically (write, fsync, rename, fsync the dir).
+#   Journal appends are made durable by group commit: the append happens under
+#   the state lock, the fsync after it's released, under a lock of its own.
+#   {journal}.synced records how far the journal is known synced, an updater
+#   finding its append already covered by someone else's fsync is done.  A
+#   burst of hooks then shares a handful of fsyncs instead of one each.
+#
+#   The mark holds the journal's inode next to the offset, and a mark for
+#   another inode or past the journal's end counts as 0.  Compaction makes the
+#   mark 0 durable before it truncates, a crash can't leave a stale large
+#   offset vouching for appends that were never synced.  The directory is
+#   synced when the journal is created, or the whole file could go missing.
+
+# NOTE
+#   The locks are a plain flock on the lock file, which is what the filelock
+#   package takes on unix too, minus the import of asyncio every hook run paid
+#   for it.  Closing the fd releases the lock, a crashed holder can't leave it
+#   held.
+
+# compact once the journal holds this many transactions
+compact_records = 128
+
+def journal_path(state_path):
+    return state_path.with_name(f'{state_path.name}.journal')
+
+def synced_path(state_path):
+    return state_path.with_name(f'{state_path.name}.journal.synced')
+
+def sync_lock_path(state_path):
+    return state_path.with_name(f'{state_path.name}.journal.sync.lock')
+
+@contextlib.contextmanager
+def file_lock(path):
+    fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o644)
+    try:
+        fcntl.flock(fd, fcntl.LOCK_EX)
+        yield
+    finally:
+        os.close(fd)
+
+# how far the journal with inode ino and size is known synced, see NOTE
+def read_synced(state_path, ino, size):
+    try:
+        mark_ino, offset = map(int, synced_path(state_path).read_text().split())
+    except (FileNotFoundError, ValueError):
+        return 0
+    if mark_ino != ino or offset > size:
+        return 0
+    return offset
+
+def write_synced(state_path, ino, offset, *, sync=False):
+    fd = os.open(synced_path(state_path), os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+    try:
+        os.write(fd, f'{ino} {offset}'.encode())
+        if sync:
+            os.fsync(fd)
+    finally:
+        os.close(fd)
+
+def fsync_dir(path):
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        os.fsync(fd)
+    finally:
+        os.close(fd)
+
+# changes whenever the snapshot is replaced, None if there is none
+def snapshot_id(state_path):
+    try:
+        st = os.stat(state_path)
+    except FileNotFoundError:
+        return None
+    return (st.st_ino, st.st_mtime_ns)
+
+# returns the snapshot's data and gen, or (None, 0)
+def read_snapshot(state_path):
+    if not state_path.exists():
+        return None, 0
+    data = json.loads(state_path.read_text())
+    return data, data.pop('gen', 0)
+
+# returns [(gen, ops)] after gen, the offset the journal ends at, and the number of records
+def read_journal(state_path, gen=0, offset=0):
+    path = journal_path(state_path)
+    try:
+        f = open(path, 'rb')
+    except FileNotFoundError:
+        return [], 0, 0
+    records = []
+    count = 0
+    with f:
+        f.seek(offset)
+        for line in f:
+            if not line.endswith(b'\n'):
+                # torn write, the transaction never completed
+                break
+            record = json.loads(line)
+            count += 1
+            offset += len(line)
+            if record['gen'] > gen:
+                records.append((record['gen'], record['ops']))
+    return records, offset, count
+
+# offset is where read_journal stopped, a torn line past it is cut off first
+#   returns the offset the record ends at, see sync_journal
+def append_journal(state_path, gen, ops, offset):
+    line = json.dumps({ 'gen': gen, 'ops': ops }, sort_keys=True).encode() + b'\n'
+    path = journal_path(state_path)
+    try:
+        fd = os.open(path, os.O_WRONLY | os.O_APPEND)
+    except FileNotFoundError:
+        fd = os.open(path, os.O_WRONLY | os.O_APPEND | os.O_CREAT, 0o644)
+        # a new file, its directory entry has to be durable before any fsync of it counts
+        try:
+            fsync_dir(state_path.parent)
+        except:
+            os.close(fd)
+            raise
+    try:
+        if os.fstat(fd).st_size > offset:
+            os.ftruncate(fd, offset)
+        os.write(fd, line)
+        return offset + len(line)
+    finally:
+        os.close(fd)
+
+# make the journal durable up to end, unless somebody already did
+def sync_journal(state_path, end):
+    with file_lock(sync_lock_path(state_path)):
+        fd = os.open(journal_path(state_path), os.O_RDONLY)
+        try:
+            st = os.fstat(fd)
+            if read_synced(state_path, st.st_ino, st.st_size) >= end:
+                return
+            # everything appended up to now rides along
+            os.fsync(fd)
+        finally:
+            os.close(fd)
+        write_synced(state_path, st.st_ino, st.st_size)
+
+def write_snapshot(state_path, gen, data):
+    data = dict(data)
+    data['gen'] = gen
+    tmp = state_path.with_name(f'.{state_path.name}.tmp')
+    fd = os.open(tmp, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+    try:
+        os.write(fd, json.dumps(data).encode())
+        os.fsync(fd)
+    finally:
+        os.close(fd)
+    os.replace(tmp, state_path)
+    fsync_dir(state_path.parent)
+
+# fold the journal into the snapshot, the snapshot goes first, see NOTE
+#   the sync lock keeps a concurrent sync_journal from recording a pre truncate size
+#   the mark goes to 0 durably before the truncate, see NOTE
+def compact(state_path, gen, data):
+    write_snapshot(state_path, gen, data)
+    with file_lock(sync_lock_path(state_path)):
+        try:
+            ino = os.stat(journal_path(state_path)).st_ino
+        except FileNotFoundError:
+            return
+        write_synced(state_path, ino, 0, sync=True)
+        os.truncate(journal_path(state_path), 0)
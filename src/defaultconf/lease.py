@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+
+import argparse
+import calendar
+import json
+import logging
+import os
+import re
+import select
+import socket
+import threading
+import time
+from collections import namedtuple
+
+from .netaddr import *
+
+# NOTE
+#   dhclient appends every lease it gets to its lease file and now and then
+#   truncates and rewrites it.  Each file is followed from the offset read so
+#   far, only whole lease blocks are parsed, the last one is current.  Gateways
+#   are written to State only when a lease's router set differs from what was
+#   registered, a renewal giving the same routers costs a read and a parse.
+#   Lease expiry sits on the daemon's timers, pushed out by every renewal.
+#
+#   Files are watched with kqueue EVFILT_VNODE, without kqueue they are stat'ed
+#   once a second.
+
+lease_re = re.compile(r'lease\s*\{([^}]*)\}')
+
+class Lease(namedtuple('Lease', ['interface', 'routers', 'expire'])):
+    pass
+
+# the body of one lease block, see dhclient.leases(5)
+def parse_lease(body):
+    interface = None
+    routers = ()
+    expire = None
+    for statement in body.split(';'):
+        words = statement.split()
+        if not words:
+            continue
+        if words[0] == 'interface' and len(words) == 2:
+            interface = words[1].strip('"')
+        elif words[:2] == ['option', 'routers'] and len(words) > 2:
+            addrs = ''.join(words[2:]).split(',')
+            routers = tuple(parse_ip_address(e)[1] for e in addrs if e)
+        elif words[0] == 'expire' and len(words) == 4:
+            # weekday date time, utc
+            expire = calendar.timegm(time.strptime(f'{words[2]} {words[3]}', '%Y/%m/%d %H:%M:%S'))
+    return Lease(interface, routers, expire)
+
+class LeaseFile:
+
+    def __init__(self, link, path):
+        self.link = link
+        self.path = path
+        self.ino = None
+        self.offset = 0
+        self.pending = ''
+        self.lease = None
+
+    def stat(self):
+        try:
+            st = os.stat(self.path)
+        except FileNotFoundError:
+            return None
+        return (st.st_ino, st.st_size, st.st_mtime_ns)
+
+    # read what was appended, returns whether there's a new current lease
+    def update(self):
+        try:
+            f = open(self.path, 'r')
+        except FileNotFoundError:
+            return False
+        with f:
+            st = os.fstat(f.fileno())
+            if st.st_ino != self.ino or st.st_size < self.offset:
+                # replaced or truncated, start over
+                self.ino = st.st_ino
+                self.offset = 0
+                self.pending = ''
+            f.seek(self.offset)
+            data = f.read()
+            self.offset = f.tell()
+        text = self.pending + data
+        end = 0
+        lease = None
+        for match in lease_re.finditer(text):
+            e = parse_lease(match.group(1))
+            if e.interface is None or e.interface == self.link:
+                lease = e
+            end = match.end()
+        self.pending = text[end:]
+        if lease is None:
+            return False
+        self.lease = lease
+        return True
+
+class LeaseWatcher:
+
+    # leases is link -> path, known is link -> the routers registered now
+    def __init__(self, leases, on_change, *, timers=None, known=None):
+        self.files = [ LeaseFile(link, path) for link, path in leases.items() ]
+        self.on_change = on_change
+        self.timers = timers
+        self.lock = threading.Lock()
+        self.known = dict(known or {})
+
+    def _apply(self, lease_file, now):
+        link = lease_file.link
+        lease = lease_file.lease
+        expired = lease.expire is not None and lease.expire <= now
+        routers = () if expired else lease.routers
+        if self.timers is not None and not expired and lease.expire is not None:
+            self.timers.set(('lease', link), lease.expire, lambda: self._expire(lease_file))
+        with self.lock:
+            if self.known.get(link, ()) == routers:
+                return
+            self.known[link] = routers
+        logging.info(f'lease on {link}: {" ".join(str(to_ip_address(socket.AF_INET, e)) for e in routers)}')
+        self.on_change(link, list(routers))
+
+    def _expire(self, lease_file):
+        self._apply(lease_file, time.time())
+
+    def _process(self, lease_file):
+        try:
+            if lease_file.update():
+                self._apply(lease_file, time.time())
+        except Exception as e:
+            logging.error(f'{lease_file.path}: {e}')
+
+    def run(self, finish):
+        for lease_file in self.files:
+            self._process(lease_file)
+        if hasattr(select, 'kqueue'):
+            self._run_kqueue(finish)
+        else:
+            self._run_stat(finish)
+
+    def _run_stat(self, finish):
+        stats = { e.path: e.stat() for e in self.files }
+        while not finish.wait(1):
+            for lease_file in self.files:
+                st = lease_file.stat()
+                if st != stats[lease_file.path]:
+                    stats[lease_file.path] = st
+                    self._process(lease_file)
+
+    def _run_kqueue(self, finish):
+        kq = select.kqueue()
+        fds = {}
+        fflags = select.KQ_NOTE_WRITE | select.KQ_NOTE_EXTEND | select.KQ_NOTE_DELETE | select.KQ_NOTE_RENAME
+        def watch(lease_file):
+            try:
+                fd = os.open(lease_file.path, os.O_RDONLY)
+            except FileNotFoundError:
+                return False
+            fds[fd] = lease_file
+            kq.control([select.kevent(fd, select.KQ_FILTER_VNODE, select.KQ_EV_ADD | select.KQ_EV_CLEAR,
+                    fflags)], 0)
+            return True
+        unwatched = [ e for e in self.files if not watch(e) ]
+        try:
+            while not finish.is_set():
+                # files that don't exist (yet) are looked for on every wakeup
+                for lease_file in list(unwatched):
+                    if watch(lease_file):
+                        unwatched.remove(lease_file)
+                        self._process(lease_file)
+                for event in kq.control(None, len(self.files), 1):
+                    lease_file = fds.get(event.ident)
+                    if lease_file is None:
+                        continue
+                    if event.fflags & (select.KQ_NOTE_DELETE | select.KQ_NOTE_RENAME):
+                        os.close(event.ident)
+                        del fds[event.ident]
+                        unwatched.append(lease_file)
+                        continue
+                    self._process(lease_file)
+        finally:
+            for fd in fds:
+                os.close(fd)
+            kq.close()
+
+# follow lease files by hand, printing router set changes
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('lease', metavar='link=path', nargs='+')
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.INFO)
+    leases = dict(e.split('=', 1) for e in args.lease)
+
+    def on_change(link, routers):
+        print(json.dumps({ 'link': link, 'routers': [ str(to_ip_address(socket.AF_INET, e)) for e in routers ] }))
+
+    try:
+        LeaseWatcher(leases, on_change).run(threading.Event())
+    except KeyboardInterrupt:
+        pass
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+
+import socket
+import threading
+from collections import namedtuple
+
+from .netaddr import *
+
+# NOTE
+#   Rolling per gateway path quality out of the prober's samples.  rtt, jitter
+#   (mean rtt delta) and loss are ewma smoothed so a single slow or lost probe
+#   doesn't reorder anything.  The active default gets a bonus in its cost, a
+#   contender has to be clearly better before traffic moves (hysteresis).
+
+# smoothing factor, ~ the last 1/alpha samples dominate
+ALPHA = 0.2
+# a contender must beat the active cost by this fraction
+HYSTERESIS = 0.2
+# and by at least this many seconds, lan rtts are all noise at this scale
+HYSTERESIS_MIN = 0.002
+# loss never makes a path infinitely expensive, keeps the ordering total
+LOSS_MAX = 0.95
+
+class PathMetrics(namedtuple('PathMetrics', ['rtt', 'jitter', 'loss', 'last_rtt', 'samples'],
+            defaults=[None, 0.0, 0.0, None, 0])):
+
+    def update(self, rtt):
+        if rtt is None:
+            return self._replace(loss=(1 - ALPHA) * self.loss + ALPHA, samples=self.samples + 1)
+        if self.rtt is None:
+            return PathMetrics(rtt, 0.0, (1 - ALPHA) * self.loss, rtt, self.samples + 1)
+        return PathMetrics((1 - ALPHA) * self.rtt + ALPHA * rtt,
+                (1 - ALPHA) * self.jitter + ALPHA * abs(rtt - self.last_rtt),
+                (1 - ALPHA) * self.loss,
+                rtt,
+                self.samples + 1)
+
+    # expected seconds per delivered packet, roughly
+    def cost(self):
+        return (self.rtt + 4 * self.jitter) / (1 - min(self.loss, LOSS_MAX))
+
+    def to_data(self):
+        return self._asdict()
+
+class Measurements:
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.paths = {}
+        self.active = {}
+
+    def update(self, af, link, addr, rtt):
+        with self.lock:
+            key = (af, link, addr)
+            self.paths[key] = self.paths.get(key, PathMetrics()).update(rtt)
+
+    def get(self, af, link, addr):
+        with self.lock:
+            return self.paths.get((af, link, addr))
+
+    def set_active(self, af, gateway):
+        with self.lock:
+            self.active[af] = None if gateway is None else (gateway.af, gateway.link, gateway.addr)
+
+    # drop what isn't probed anymore
+    def retain(self, keys):
+        with self.lock:
+            for key in set(self.paths) - set(keys):
+                del self.paths[key]
+
+    def to_data(self):
+        with self.lock:
+            data = []
+            for (af, link, addr), path in self.paths.items():
+                e = { 'af': socket.AddressFamily(af).name, 'link': link, 'addr': str(to_ip_address(af, addr)) }
+                e.update(path.to_data())
+                data.append(e)
+            return data
+
+    def cost(self, af, link, addr):
+        with self.lock:
+            key = (af, link, addr)
+            path = self.paths.get(key)
+            if path is None or path.rtt is None:
+                return None
+            cost = path.cost()
+            if self.active.get(af) == key:
+                cost = max(0.0, cost - max(cost * HYSTERESIS, HYSTERESIS_MIN))
+            return cost
+
+# measured gateways first, cheapest first, then newest registration as before
+#   sorted with reverse=True, so bigger is better
+def performance_sort_strategy(measurements):
+    def key(e):
+        cost = None if measurements is None else measurements.cost(e.af, e.link, e.addr)
+        if cost is None:
+            return (False, 0.0, e.ts, -e.rank)
+        return (True, -cost, e.ts, -e.rank)
+    return key
@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+
+import socket
+
+# addresses are kept as plain ints (network byte order, msb first) alongside
+# their af, ipaddress objects are only built at the edges
+
+def addr_width(af):
+    if af == socket.AF_INET:
+        return 32
+    elif af == socket.AF_INET6:
+        return 128
+    raise Exception(f'unsupported af: {af}')
+
+def prefix_mask(af, prefixlen):
+    width = addr_width(af)
+    return ((1 << prefixlen) - 1) << (width - prefixlen)
+
+def addr_in(af, addr, prefix, prefixlen):
+    mask = prefix_mask(af, prefixlen)
+    return (addr & mask) == (prefix & mask)
+
+def from_packed(packed):
+    return int.from_bytes(packed, 'big')
+
+def to_packed(af, addr):
+    return addr.to_bytes(addr_width(af) // 8, 'big')
+
+def to_ip_address(af, addr):
+    import ipaddress
+    if af == socket.AF_INET:
+        return ipaddress.IPv4Address(addr)
+    elif af == socket.AF_INET6:
+        return ipaddress.IPv6Address(addr)
+    raise Exception(f'unsupported af: {af}')
+
+def to_ip_network(af, addr, prefixlen):
+    import ipaddress
+    if af == socket.AF_INET:
+        return ipaddress.IPv4Network((addr, prefixlen))
+    elif af == socket.AF_INET6:
+        return ipaddress.IPv6Network((addr, prefixlen))
+    raise Exception(f'unsupported af: {af}')
+
+def from_ip_address(ip):
+    af = socket.AF_INET if ip.version == 4 else socket.AF_INET6
+    return af, int(ip)
+
+def from_ip_network(net):
+    af = socket.AF_INET if net.version == 4 else socket.AF_INET6
+    return af, int(net.network_address), net.prefixlen
+
+# inet_pton/inet_ntop, not ipaddress, these are on the path of every hook run
+#   a scope (fe80::1%em0) is dropped, as int(ipaddress.IPv6Address(...)) does
+def parse_ip_address(s):
+    s = s.split('%', 1)[0]
+    for af in (socket.AF_INET, socket.AF_INET6):
+        try:
+            return af, from_packed(socket.inet_pton(af, s))
+        except OSError:
+            pass
+    raise ValueError(f'{s!r} does not appear to be an IPv4 or IPv6 address')
+
+def format_ip_address(af, addr):
+    return socket.inet_ntop(af, to_packed(af, addr))
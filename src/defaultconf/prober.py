@@ -0,0 +1,303 @@
+#!/usr/bin/env python3
+
+import argparse
+import errno
+import logging
+import os
+import select
+import socket
+import struct
+import threading
+import time
+from collections import deque, namedtuple
+
+from .netaddr import *
+
+# sys/socket.h, not exported by the socket module
+SO_SETFIB = 0x1014
+
+ICMP_ECHO = 8
+ICMP_ECHOREPLY = 0
+ICMP6_ECHO_REQUEST = 128
+ICMP6_ECHO_REPLY = 129
+
+# NOTE
+#   default_test only sees local state, a gateway can be up on its link and still
+#   drop everything.  Every candidate gets a small probe each interval, either an
+#   icmp echo or a udp datagram to a closed port (the port unreachable coming
+#   back proves the gateway forwards to its own stack as well as an echo does).
+#   A candidate is dead once `loss` of the last `window` probes went unanswered,
+#   alive again once a full window is under the threshold.
+#
+#   There is no SO_BINDTODEVICE here, candidates are on link so the connected
+#   route already takes the probe out the right interface, inet6 link locals
+#   carry the scope.
+
+def checksum(data):
+    if len(data) % 2:
+        data += b'\0'
+    s = sum(struct.unpack(f'!{len(data) // 2}H', data))
+    s = (s >> 16) + (s & 0xffff)
+    s += s >> 16
+    return ~s & 0xffff
+
+def build_echo(af, ident, seq):
+    payload = struct.pack('!d', time.monotonic())
+    if af == socket.AF_INET:
+        hdr = struct.pack('!BBHHH', ICMP_ECHO, 0, 0, ident, seq)
+        csum = checksum(hdr + payload)
+        return struct.pack('!BBHHH', ICMP_ECHO, 0, csum, ident, seq) + payload
+    # the kernel fills in the icmp6 checksum on raw sockets
+    return struct.pack('!BBHHH', ICMP6_ECHO_REQUEST, 0, 0, ident, seq) + payload
+
+# returns (ident, seq) of an echo reply, or None
+def parse_echo_reply(af, data):
+    if af == socket.AF_INET:
+        # raw inet sockets hand over the ip header too
+        if len(data) < 20:
+            return None
+        data = data[(data[0] & 0x0f) * 4:]
+        reply_type = ICMP_ECHOREPLY
+    else:
+        reply_type = ICMP6_ECHO_REPLY
+    if len(data) < 8:
+        return None
+    icmp_type, _, _, ident, seq = struct.unpack('!BBHHH', data[:8])
+    if icmp_type != reply_type:
+        return None
+    return ident, seq
+
+def sockaddr(af, addr, port, link_index):
+    if af == socket.AF_INET:
+        return (str(to_ip_address(af, addr)), port)
+    return (str(to_ip_address(af, addr)), port, 0, link_index)
+
+class ProbeConfig(namedtuple('ProbeConfig', ['method', 'interval', 'timeout', 'window', 'loss', 'port'],
+            defaults=['icmp', 0.1, 0.3, 5, 3, 33434])):
+
+    @staticmethod
+    def from_data(data):
+        probe = ProbeConfig(**data)
+        if probe.method not in ('icmp', 'udp'):
+            raise Exception(f'unknown probe method: {probe.method}')
+        if not 0 < probe.loss <= probe.window:
+            raise Exception(f'probe loss must be within 1..{probe.window}')
+        return probe
+
+# a candidate, af/addr as in Gateway
+class Target(namedtuple('Target', ['af', 'link', 'addr', 'link_index'])):
+    pass
+
+class Sample(namedtuple('Sample', ['ts', 'rtt'])):
+    pass
+
+# results of one target, rtt is None for a lost probe
+class TargetState:
+
+    def __init__(self, window):
+        self.results = deque(maxlen=window)
+        self.outstanding = {}
+        self.alive = True
+        self.sock = None
+        self.last = None
+
+    def losses(self):
+        return sum(1 for e in self.results if e.rtt is None)
+
+class Prober:
+
+    def __init__(self, probe, *, fib=0, on_change=None, on_sample=None):
+        self.probe = probe
+        self.fib = fib
+        self.on_change = on_change
+        self.on_sample = on_sample
+        self.lock = threading.Lock()
+        self.targets = {}
+        self.ident = os.getpid() & 0xffff
+        self.seq = 0
+        self.icmp = {}
+
+    def _socket(self, af, kind, proto):
+        sock = socket.socket(af, kind, proto)
+        sock.setblocking(False)
+        if self.fib:
+            sock.setsockopt(socket.SOL_SOCKET, SO_SETFIB, self.fib)
+        return sock
+
+    def _icmp_socket(self, af):
+        sock = self.icmp.get(af)
+        if sock is None:
+            proto = socket.IPPROTO_ICMP if af == socket.AF_INET else socket.IPPROTO_ICMPV6
+            sock = self._socket(af, socket.SOCK_RAW, proto)
+            self.icmp[af] = sock
+        return sock
+
+    # replace the candidate set, state of targets that stay is kept
+    def set_targets(self, targets):
+        with self.lock:
+            targets = set(targets)
+            for target in list(self.targets):
+                if target not in targets:
+                    state = self.targets.pop(target)
+                    if state.sock is not None:
+                        state.sock.close()
+            for target in targets:
+                if target not in self.targets:
+                    self.targets[target] = TargetState(self.probe.window)
+
+    # unknown and not yet judged targets count as alive
+    def is_alive(self, af, link, addr):
+        with self.lock:
+            for target, state in self.targets.items():
+                if (target.af, target.link, target.addr) == (af, link, addr):
+                    return state.alive
+            return True
+
+    def _next_seq(self):
+        self.seq = (self.seq + 1) & 0xffff
+        return self.seq
+
+    def _send(self, target, state, now):
+        seq = self._next_seq()
+        try:
+            if self.probe.method == 'icmp':
+                sock = self._icmp_socket(target.af)
+                sock.sendto(build_echo(target.af, self.ident, seq),
+                        sockaddr(target.af, target.addr, 0, target.link_index))
+            else:
+                if state.sock is None:
+                    state.sock = self._socket(target.af, socket.SOCK_DGRAM, 0)
+                    state.sock.connect(sockaddr(target.af, target.addr, self.probe.port, target.link_index))
+                state.sock.send(struct.pack('!H', seq))
+        except OSError as e:
+            # unreachable right away, count it as lost
+            logging.debug(f'probe {target} send failed: {e}')
+        state.outstanding[seq] = now
+
+    def _record(self, target, state, sent, rtt):
+        sample = Sample(sent, rtt)
+        state.results.append(sample)
+        losses = state.losses()
+        changed = False
+        if state.alive and losses >= self.probe.loss:
+            state.alive = False
+            changed = True
+        elif not state.alive and len(state.results) == state.results.maxlen and losses < self.probe.loss:
+            state.alive = True
+            changed = True
+        return sample, changed
+
+    def _answer(self, target, state, seq, now, events):
+        sent = state.outstanding.pop(seq, None)
+        if sent is None:
+            return
+        sample, changed = self._record(target, state, sent, now - sent)
+        events.append((target, sample, state.alive if changed else None))
+
+    def _recv_icmp(self, af, sock, now, events):
+        while True:
+            try:
+                data, src = sock.recvfrom(2048)
+            except BlockingIOError:
+                return
+            reply = parse_echo_reply(af, data)
+            if reply is None or reply[0] != self.ident:
+                continue
+            _, addr = parse_ip_address(src[0].split('%')[0])
+            for target, state in self.targets.items():
+                if target.af == af and target.addr == addr:
+                    self._answer(target, state, reply[1], now, events)
+
+    def _recv_udp(self, target, state, now, events):
+        while True:
+            try:
+                data = state.sock.recv(2048)
+            except BlockingIOError:
+                return
+            except ConnectionRefusedError:
+                # port unreachable, the gateway is there, take the oldest probe
+                if state.outstanding:
+                    self._answer(target, state, next(iter(state.outstanding)), now, events)
+                continue
+            except OSError as e:
+                if e.errno in (errno.EHOSTUNREACH, errno.ENETUNREACH, errno.EHOSTDOWN):
+                    continue
+                raise
+            if len(data) >= 2:
+                self._answer(target, state, struct.unpack('!H', data[:2])[0], now, events)
+
+    def _expire(self, now, events):
+        for target, state in self.targets.items():
+            for seq, sent in list(state.outstanding.items()):
+                if now - sent < self.probe.timeout:
+                    continue
+                del state.outstanding[seq]
+                sample, changed = self._record(target, state, sent, None)
+                events.append((target, sample, state.alive if changed else None))
+
+    def _notify(self, events):
+        for target, sample, alive in events:
+            if self.on_sample is not None:
+                self.on_sample(target, sample)
+            if alive is not None:
+                logging.info(f'probe {target.link} {to_ip_address(target.af, target.addr)} {"alive" if alive else "dead"}')
+                if self.on_change is not None:
+                    self.on_change(target, alive)
+
+    def run(self, finish):
+        next_round = time.monotonic()
+        while not finish.is_set():
+            now = time.monotonic()
+            events = []
+            with self.lock:
+                if now >= next_round:
+                    for target, state in self.targets.items():
+                        self._send(target, state, now)
+                    next_round = now + self.probe.interval
+                socks = list(self.icmp.values())
+                socks.extend(state.sock for state in self.targets.values() if state.sock is not None)
+            wait = max(0, min(next_round - time.monotonic(), self.probe.timeout))
+            if socks:
+                readable, _, _ = select.select(socks, [], [], wait)
+            else:
+                readable = []
+                finish.wait(wait)
+            now = time.monotonic()
+            with self.lock:
+                for af, sock in self.icmp.items():
+                    if sock in readable:
+                        self._recv_icmp(af, sock, now, events)
+                for target, state in self.targets.items():
+                    if state.sock is not None and state.sock in readable:
+                        self._recv_udp(target, state, now, events)
+                self._expire(now, events)
+            # callbacks outside the lock, they may call back into is_alive
+            self._notify(events)
+
+# probe a single address by hand, e.g. against 127.0.0.1/::1 or a responder on a tap
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-m', metavar='method', choices=['icmp', 'udp'], default='icmp')
+    parser.add_argument('-i', metavar='interval', type=float, default=ProbeConfig().interval)
+    parser.add_argument('-t', metavar='timeout', type=float, default=ProbeConfig().timeout)
+    parser.add_argument('-p', metavar='port', type=int, default=ProbeConfig().port)
+    parser.add_argument('-l', metavar='link', default='lo0')
+    parser.add_argument('-n', metavar='link-index', type=int, default=0)
+    parser.add_argument('addr', metavar='address')
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.INFO)
+    probe = ProbeConfig.from_data({'method': args.m, 'interval': args.i, 'timeout': args.t, 'port': args.p})
+    af, addr = parse_ip_address(args.addr)
+
+    def on_sample(target, sample):
+        rtt = 'lost' if sample.rtt is None else f'{sample.rtt * 1000:.3f}ms'
+        print(f'{args.addr} {rtt}')
+
+    prober = Prober(probe, on_sample=on_sample)
+    prober.set_targets([Target(af, args.l, addr, args.n)])
+    finish = threading.Event()
+    try:
+        prober.run(finish)
+    except KeyboardInterrupt:
+        pass
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+
+import math
+import mmap
+import os
+import socket
+import struct
+import threading
+import time
+
+from .netaddr import *
+
+# NOTE
+#   The daemon's current default per af, published in a small file everyone
+#   maps.  A seqlock guards it: the writer makes seq odd, writes, makes it even
+#   again, readers retry until they saw the same even seq before and after
+#   copying.  get-default then costs an open and a few struct unpacks and shows
+#   what is installed, not what a fresh DefaultConf would compute.
+#
+#   Only the default (0/0) is managed so there's one slot per af.  CPython does
+#   each mmap access as a plain copy in program order, which is all the
+#   ordering the seqlock needs on the platforms we run on.
+#
+#   The file is only believed while its writer runs.  A daemon killed mid
+#   publish leaves seq odd for good, that reads as nothing published, and the
+#   daemon unlinks the file when it stops so a reused pid can't revive it.
+
+magic = b'DCD1'
+# magic, writer pid, seq
+header = struct.Struct('<4sIQ')
+# af, present, rank, link, protocol, addr, ts, expires (nan for none)
+slot = struct.Struct('<BBxxI16s16s16sdd')
+slot_afs = (socket.AF_INET, socket.AF_INET6)
+size = header.size + slot.size * len(slot_afs)
+
+class Publisher:
+
+    def __init__(self, path):
+        self.lock = threading.Lock()
+        self.path = path
+        fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o644)
+        try:
+            os.ftruncate(fd, size)
+            self.mm = mmap.mmap(fd, size)
+        finally:
+            os.close(fd)
+        self.seq = 0
+        header.pack_into(self.mm, 0, magic, os.getpid(), self.seq)
+        for af in slot_afs:
+            self._pack(af, None)
+
+    def _pack(self, af, gateway):
+        offset = header.size + slot.size * slot_afs.index(af)
+        if gateway is None:
+            slot.pack_into(self.mm, offset, af, 0, 0, b'', b'', b'', 0.0, math.nan)
+            return
+        expires = math.nan if gateway.expires is None else gateway.expires
+        slot.pack_into(self.mm, offset, af, 1, gateway.rank, gateway.link.encode(), gateway.protocol.encode(),
+                to_packed(af, gateway.addr).ljust(16, b'\0'), gateway.ts, expires)
+
+    def publish(self, af, gateway):
+        with self.lock:
+            self.seq += 1
+            struct.pack_into('<Q', self.mm, 8, self.seq)
+            self._pack(af, gateway)
+            self.seq += 1
+            struct.pack_into('<Q', self.mm, 8, self.seq)
+
+    def close(self):
+        self.mm.close()
+
+    # readers take a missing file as no daemon
+    def unlink(self):
+        try:
+            os.unlink(self.path)
+        except FileNotFoundError:
+            pass
+
+def writer_alive(pid):
+    try:
+        os.kill(pid, 0)
+    except ProcessLookupError:
+        return False
+    except PermissionError:
+        pass
+    return True
+
+# returns af -> (af, link, protocol, addr, ts, rank, expires) or None, None if
+#   nothing was published, the writer is gone or no consistent read was had
+def read_decision(path, *, retries=1000):
+    try:
+        with open(path, 'rb') as f:
+            mm = mmap.mmap(f.fileno(), size, access=mmap.ACCESS_READ)
+    except (FileNotFoundError, ValueError):
+        return None
+    with mm:
+        # pid is only written at start, it's fine to read it outside the seqlock
+        found, pid, _ = header.unpack_from(mm, 0)
+        if found != magic or not writer_alive(pid):
+            return None
+        for _ in range(retries):
+            # one copy of everything, then check seq didn't move under it
+            data = mm[:size]
+            found, pid, seq = header.unpack_from(data, 0)
+            if found != magic:
+                return None
+            if not seq & 1 and header.unpack_from(mm, 0)[2] == seq:
+                break
+            # a writer in this process may hold the gil mid update, let it finish
+            time.sleep(0)
+        else:
+            return None
+    decision = {}
+    for i, af in enumerate(slot_afs):
+        _, present, rank, link, protocol, addr, ts, expires = slot.unpack_from(data, header.size + slot.size * i)
+        if not present:
+            decision[af] = None
+            continue
+        addr = from_packed(addr[:addr_width(af) // 8])
+        decision[af] = (af, link.rstrip(b'\0').decode(), protocol.rstrip(b'\0').decode(), addr, ts, rank,
+                None if math.isnan(expires) else expires)
+    return decision
@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+
+import argparse
+import json
+import logging
+import select
+import socket
+import struct
+import threading
+import time
+from collections import namedtuple
+
+from .netaddr import *
+
+ND_ROUTER_ADVERT = 134
+
+# rfc 4191 router preference, the reserved 0b10 is treated as medium
+preferences = { 0b01: 1, 0b00: 0, 0b11: -1, 0b10: 0 }
+
+# NOTE
+#   Router advertisements straight from the wire instead of a process per RA.
+#   Per link the routers heard are tracked with their lifetime and preference,
+#   the link's ra group in State is rewritten (ordered by preference, see rank)
+#   only when the set of routers changes or a lifetime is about to run out, so
+#   the periodic identical RAs cost nothing.  State.add is how every other
+#   source registers, the daemon reloads through the usual signal.
+#
+#   After a restart the first RA on a link replaces that link's group, routers
+#   that haven't been heard from yet come back with their next RA.
+
+class RAConfig(namedtuple('RAConfig', ['links', 'min_interval'],
+            defaults=[None, 1.0])):
+
+    @staticmethod
+    def from_data(data):
+        return RAConfig(**data)
+
+    def wants(self, link):
+        return self.links is None or link in self.links
+
+# returns (lifetime, preference) of a router advertisement, or None
+def parse_ra(data):
+    if len(data) < 16:
+        return None
+    icmp_type, code, _, _, flags, lifetime = struct.unpack('!BBHBBH', data[:8])
+    if icmp_type != ND_ROUTER_ADVERT or code != 0:
+        return None
+    return lifetime, preferences[(flags >> 3) & 0b11]
+
+def is_link_local(addr):
+    return (addr >> 118) == 0x3fa
+
+# the checks every RA goes through, received or replayed, returns
+#   (link, src, lifetime, preference) of a valid RA, or None
+def accept_ra(ra_config, link, src, hop_limit, data):
+    # rfc 4861 6.1.2, anything else didn't come from a router on the link
+    if hop_limit != 255 or not is_link_local(src):
+        return None
+    if not ra_config.wants(link):
+        return None
+    ra = parse_ra(data)
+    if ra is None:
+        return None
+    return (link, src) + ra
+
+class Router(namedtuple('Router', ['preference', 'lifetime', 'expires', 'seen'])):
+    pass
+
+class RATracker:
+
+    def __init__(self, ra_config):
+        self.ra_config = ra_config
+        self.links = {}
+
+    # returns the link's routers [(addr, lifetime)] best first if they need writing, else None
+    def handle(self, link, src, lifetime, preference, now):
+        routers = self.links.setdefault(link, {})
+        current = routers.get(src)
+        if lifetime == 0:
+            # no longer a default router
+            if current is None:
+                return None
+            del routers[src]
+            return self.group(link, now)
+        # only repeats are rate limited, a changed preference or lifetime is written right away
+        if current is not None and (current.preference, current.lifetime) == (preference, lifetime):
+            if now - current.seen < self.ra_config.min_interval:
+                return None
+            # the same thing again well within its lifetime, nothing to write
+            if current.expires - now > lifetime / 2:
+                routers[src] = current._replace(seen=now)
+                return None
+        routers[src] = Router(preference, lifetime, now + lifetime, now)
+        return self.group(link, now)
+
+    def group(self, link, now):
+        routers = self.links.get(link, {})
+        for addr in [ k for k, v in routers.items() if v.expires <= now ]:
+            del routers[addr]
+        ordered = sorted(routers.items(), key=lambda e: (-e[1].preference, e[0]))
+        return [ (addr, router.expires - now) for addr, router in ordered ]
+
+class RAListener:
+
+    def __init__(self, ra_config):
+        self.ra_config = ra_config
+        self.tracker = RATracker(ra_config)
+        self.sock = socket.socket(socket.AF_INET6, socket.SOCK_RAW, socket.IPPROTO_ICMPV6)
+        self.sock.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_RECVPKTINFO, 1)
+        self.sock.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_RECVHOPLIMIT, 1)
+        self.cmsg_size = socket.CMSG_SPACE(20) + socket.CMSG_SPACE(4)
+
+    # returns (link, src, lifetime, preference) of a valid RA, or None
+    def recv(self):
+        data, ancdata, _, src = self.sock.recvmsg(1500, self.cmsg_size)
+        link_index = None
+        hop_limit = None
+        for level, kind, value in ancdata:
+            if level != socket.IPPROTO_IPV6:
+                continue
+            if kind == socket.IPV6_PKTINFO:
+                link_index, = struct.unpack('I', value[16:20])
+            elif kind == socket.IPV6_HOPLIMIT:
+                hop_limit, = struct.unpack('i', value[:4])
+        if link_index is None:
+            return None
+        _, addr = parse_ip_address(src[0])
+        return accept_ra(self.ra_config, socket.if_indextoname(link_index), addr, hop_limit, data)
+
+    def run(self, finish, on_change):
+        while not finish.is_set():
+            readable, _, _ = select.select([self.sock], [], [], 1)
+            if not readable:
+                continue
+            try:
+                ra = self.recv()
+            except OSError as e:
+                logging.error(e)
+                continue
+            if ra is None:
+                continue
+            link, addr, lifetime, preference = ra
+            group = self.tracker.handle(link, addr, lifetime, preference, time.time())
+            if group is not None:
+                on_change(link, group)
+
+# read ethernet, bsd loopback or raw ip captures, yields (ts, ipv6 packet)
+def read_pcap(path):
+    with open(path, 'rb') as f:
+        header = f.read(24)
+        magic = header[:4]
+        if magic in (b'\xd4\xc3\xb2\xa1', b'\x4d\x3c\xb2\xa1'):
+            endian = '<'
+        elif magic in (b'\xa1\xb2\xc3\xd4', b'\xa1\xb2\x3c\x4d'):
+            endian = '>'
+        else:
+            raise Exception(f'not a pcap file: {path}')
+        # the nanosecond variant
+        frac = 1e9 if magic in (b'\x4d\x3c\xb2\xa1', b'\xa1\xb2\x3c\x4d') else 1e6
+        linktype, = struct.unpack(f'{endian}I', header[20:24])
+        while record := f.read(16):
+            sec, subsec, caplen, _ = struct.unpack(f'{endian}IIII', record)
+            frame = f.read(caplen)
+            if linktype == 1:
+                ethertype, = struct.unpack('!H', frame[12:14])
+                offset = 14
+                if ethertype == 0x8100:
+                    ethertype, = struct.unpack('!H', frame[16:18])
+                    offset = 18
+                if ethertype != 0x86dd:
+                    continue
+                packet = frame[offset:]
+            elif linktype == 0:
+                packet = frame[4:]
+            elif linktype in (12, 101):
+                packet = frame
+            else:
+                raise Exception(f'unsupported linktype: {linktype}')
+            if len(packet) >= 40 and packet[0] >> 4 == 6:
+                yield sec + subsec / frac, packet
+
+# replay RAs from a capture, or listen, printing what would be registered
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-r', metavar='pcap-path')
+    parser.add_argument('-l', metavar='link', default='em0')
+    parser.add_argument('-i', metavar='min-interval', type=float, default=RAConfig().min_interval)
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.INFO)
+    ra_config = RAConfig(min_interval=args.i)
+
+    def on_change(link, group):
+        print(json.dumps({ 'link': link, 'routers': [
+            { 'addr': str(to_ip_address(socket.AF_INET6, addr)), 'lifetime': round(lifetime) }
+            for addr, lifetime in group ] }))
+
+    if args.r is None:
+        RAListener(ra_config).run(threading.Event(), on_change)
+        return
+
+    tracker = RATracker(ra_config)
+    for ts, packet in read_pcap(args.r):
+        # what the raw icmpv6 socket hands the listener, no extension headers in RAs worth replaying
+        if packet[6] != socket.IPPROTO_ICMPV6:
+            continue
+        ra = accept_ra(ra_config, args.l, from_packed(packet[8:24]), packet[7], packet[40:])
+        if ra is None:
+            continue
+        link, addr, lifetime, preference = ra
+        # the capture's own clock, so rate limiting and expiry replay as they happened
+        group = tracker.handle(link, addr, lifetime, preference, ts)
+        if group is not None:
+            on_change(link, group)
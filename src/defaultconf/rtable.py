@@ -0,0 +1,273 @@
+#!/usr/bin/env python3
+
+from array import array
+
+from .netaddr import *
+
+# NOTE
+#   A full table mirrored as sets of namedtuples holding ipaddress objects costs
+#   several hundred bytes per route.  These tables keep one row per entry spread
+#   over flat arrays (struct of arrays), so a route is ~40 bytes plus its share
+#   of the hash index.  Rows are unordered, removal swaps the last row in.
+
+# addresses of one af, 32 bit addresses fit one word, 128 bit need two
+class AddrColumn:
+
+    def __init__(self, af):
+        self.wide = addr_width(af) > 64
+        if self.wide:
+            self.hi = array('Q')
+            self.lo = array('Q')
+        else:
+            self.lo = array('I')
+
+    def __len__(self):
+        return len(self.lo)
+
+    def __getitem__(self, i):
+        if self.wide:
+            return (self.hi[i] << 64) | self.lo[i]
+        return self.lo[i]
+
+    def __setitem__(self, i, v):
+        if self.wide:
+            self.hi[i] = v >> 64
+            self.lo[i] = v & 0xffffffffffffffff
+        else:
+            self.lo[i] = v
+
+    def append(self, v):
+        if self.wide:
+            self.hi.append(v >> 64)
+            self.lo.append(v & 0xffffffffffffffff)
+        else:
+            self.lo.append(v)
+
+    def pop(self):
+        if self.wide:
+            self.hi.pop()
+        self.lo.pop()
+
+_EMPTY = -1
+_DELETED = -2
+_GOLDEN = 0x9e3779b97f4a7c15
+_MASK64 = 0xffffffffffffffff
+
+# routes of a single af, unique by (dst, dst_len, gw, oif).  A prefix can have
+#   several, ecmp next hops, or other fibs' routes while the nl filter isn't in
+#   force, none of them may replace another
+class RouteTable:
+
+    def __init__(self, af):
+        self.af = af
+        self.width = addr_width(af)
+        self.dst = AddrColumn(af)
+        self.dst_len = array('B')
+        # gateways are interned, a full table only has a handful of next hops
+        #   0 is reserved for 'no gateway'
+        # NOTE interned gateways are never released
+        self.gw = array('I')
+        self.gws = [None]
+        self.gw_ids = {}
+        self.oif = array('I')
+        # number of routes per prefix length, lookups only probe lengths in use
+        self.len_counts = array('I', [0]) * (self.width + 1)
+        # open addressing index hashed on (dst, dst_len) -> row, the rows of a
+        #   prefix all sit in the probe sequence of its hash
+        self.slots_bits = 3
+        self.slots = array('q', [_EMPTY]) * (1 << self.slots_bits)
+        self.slots_used = 0
+
+    def __len__(self):
+        return len(self.dst_len)
+
+    def _hash(self, dst, dst_len):
+        k = (hash(dst) ^ (dst_len << 56)) & _MASK64
+        return ((k * _GOLDEN) & _MASK64) >> (64 - self.slots_bits)
+
+    # returns the slot holding the route, or the slot where it should be inserted as ~slot
+    #   gw_id None is a gateway that was never interned, it can't be found
+    def _probe(self, dst, dst_len, gw_id, oif):
+        mask = len(self.slots) - 1
+        i = self._hash(dst, dst_len)
+        free = None
+        while True:
+            row = self.slots[i]
+            if row == _EMPTY:
+                return ~(i if free is None else free)
+            elif row == _DELETED:
+                if free is None:
+                    free = i
+            elif (self.dst_len[row] == dst_len and self.dst[row] == dst
+                    and self.gw[row] == gw_id and self.oif[row] == oif):
+                return i
+            i = (i + 1) & mask
+
+    # the rows of a prefix
+    def _prefix_rows(self, dst, dst_len):
+        mask = len(self.slots) - 1
+        i = self._hash(dst, dst_len)
+        while True:
+            row = self.slots[i]
+            if row == _EMPTY:
+                return
+            elif row >= 0 and self.dst_len[row] == dst_len and self.dst[row] == dst:
+                yield row
+            i = (i + 1) & mask
+
+    def _slot_of(self, row):
+        mask = len(self.slots) - 1
+        i = self._hash(self.dst[row], self.dst_len[row])
+        while self.slots[i] != row:
+            i = (i + 1) & mask
+        return i
+
+    def _resize(self):
+        # grow when live rows fill half the index, otherwise just drop tombstones
+        bits = self.slots_bits
+        while len(self) * 2 >= (1 << bits):
+            bits += 1
+        self.slots_bits = bits
+        self.slots = array('q', [_EMPTY]) * (1 << bits)
+        self.slots_used = len(self)
+        mask = len(self.slots) - 1
+        for row in range(len(self)):
+            i = self._hash(self.dst[row], self.dst_len[row])
+            while self.slots[i] != _EMPTY:
+                i = (i + 1) & mask
+            self.slots[i] = row
+
+    def _intern_gw(self, gw):
+        if gw is None:
+            return 0
+        gw_id = self.gw_ids.get(gw)
+        if gw_id is None:
+            gw_id = len(self.gws)
+            self.gws.append(gw)
+            self.gw_ids[gw] = gw_id
+        return gw_id
+
+    def _row(self, row):
+        return (self.dst[row], self.dst_len[row], self.gws[self.gw[row]], self.oif[row])
+
+    def add(self, dst, dst_len, gw, oif):
+        gw_id = self._intern_gw(gw)
+        slot = self._probe(dst, dst_len, gw_id, oif)
+        if slot >= 0:
+            return
+        slot = ~slot
+        if self.slots[slot] == _EMPTY:
+            self.slots_used += 1
+        row = len(self)
+        self.slots[slot] = row
+        self.dst.append(dst)
+        self.dst_len.append(dst_len)
+        self.gw.append(gw_id)
+        self.oif.append(oif)
+        self.len_counts[dst_len] += 1
+        if self.slots_used * 2 > len(self.slots):
+            self._resize()
+
+    # only removes the route with this gw and oif, the prefix's others stay
+    def remove(self, dst, dst_len, gw, oif):
+        gw_id = 0 if gw is None else self.gw_ids.get(gw)
+        slot = self._probe(dst, dst_len, gw_id, oif)
+        if slot < 0:
+            return False
+        row = self.slots[slot]
+        self.slots[slot] = _DELETED
+        self.len_counts[dst_len] -= 1
+        last = len(self) - 1
+        if row != last:
+            # move the last row into the hole and repoint its slot
+            self.slots[self._slot_of(last)] = row
+            self.dst[row] = self.dst[last]
+            self.dst_len[row] = self.dst_len[last]
+            self.gw[row] = self.gw[last]
+            self.oif[row] = self.oif[last]
+        self.dst.pop()
+        self.dst_len.pop()
+        self.gw.pop()
+        self.oif.pop()
+        return True
+
+    # the route takes the place of every route of its prefix, as RTM_CHANGE does
+    def replace(self, dst, dst_len, gw, oif):
+        for row in list(self._prefix_rows(dst, dst_len)):
+            self.remove(*self._row(row))
+        self.add(dst, dst_len, gw, oif)
+
+    def clear(self):
+        self.__init__(self.af)
+
+    # yield the routes of a prefix
+    def get(self, dst, dst_len):
+        for row in self._prefix_rows(dst, dst_len):
+            yield self._row(row)
+
+    # yield the routes containing addr, longest prefix first
+    def matches(self, addr):
+        for dst_len in range(self.width, -1, -1):
+            if not self.len_counts[dst_len]:
+                continue
+            for row in self._prefix_rows(addr & prefix_mask(self.af, dst_len), dst_len):
+                yield self._row(row)
+
+    def __iter__(self):
+        for row in range(len(self)):
+            yield self._row(row)
+
+# interface addresses of a single af, small enough that scans are fine
+class AddrTable:
+
+    def __init__(self, af):
+        self.af = af
+        self.addr = AddrColumn(af)
+        self.prefixlen = array('B')
+        self.link_index = array('I')
+
+    def __len__(self):
+        return len(self.prefixlen)
+
+    def _find(self, link_index, addr, prefixlen):
+        for row in range(len(self)):
+            if (self.link_index[row] == link_index and self.addr[row] == addr
+                    and self.prefixlen[row] == prefixlen):
+                return row
+        return None
+
+    def add(self, link_index, addr, prefixlen):
+        if self._find(link_index, addr, prefixlen) is not None:
+            return
+        self.addr.append(addr)
+        self.prefixlen.append(prefixlen)
+        self.link_index.append(link_index)
+
+    def remove(self, link_index, addr, prefixlen):
+        row = self._find(link_index, addr, prefixlen)
+        if row is None:
+            return False
+        last = len(self) - 1
+        self.addr[row] = self.addr[last]
+        self.prefixlen[row] = self.prefixlen[last]
+        self.link_index[row] = self.link_index[last]
+        self.addr.pop()
+        self.prefixlen.pop()
+        self.link_index.pop()
+        return True
+
+    def clear(self):
+        self.__init__(self.af)
+
+    # is addr inside the network of any address on link_index
+    def covers(self, link_index, addr):
+        for row in range(len(self)):
+            if self.link_index[row] != link_index:
+                continue
+            if addr_in(self.af, addr, self.addr[row], self.prefixlen[row]):
+                return True
+        return False
+
+    def __iter__(self):
+        for row in range(len(self)):
+            yield (self.link_index[row], self.addr[row], self.prefixlen[row])
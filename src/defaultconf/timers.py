@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+
+import heapq
+import itertools
+import threading
+import time
+
+# NOTE
+#   One thread sleeping until the earliest deadline of a heap, no periodic scans.
+#   Timers are keyed, setting a key again replaces its deadline, replaced and
+#   cancelled entries stay in the heap and are skipped when they come up.
+#   Deadlines are wall clock (lease and router lifetimes are), the sleep is
+#   capped at a second like every other loop of the daemon, so finish and a
+#   stepped clock are both noticed.
+
+class Timers:
+
+    def __init__(self):
+        self.cond = threading.Condition()
+        self.heap = []
+        self.entries = {}
+        self.counter = itertools.count()
+
+    def set(self, key, when, callback):
+        with self.cond:
+            entry = [when, next(self.counter), key, callback]
+            self.entries[key] = entry
+            heapq.heappush(self.heap, entry)
+            if self.heap[0] is entry:
+                self.cond.notify()
+
+    def cancel(self, key):
+        with self.cond:
+            self.entries.pop(key, None)
+
+    def keys(self):
+        with self.cond:
+            return set(self.entries)
+
+    def _pop_due(self, now):
+        due = []
+        while self.heap and self.heap[0][0] <= now:
+            entry = heapq.heappop(self.heap)
+            if self.entries.get(entry[2]) is entry:
+                del self.entries[entry[2]]
+                due.append(entry[3])
+        # shed dead entries at the top, keeps the wait below honest
+        while self.heap and self.entries.get(self.heap[0][2]) is not self.heap[0]:
+            heapq.heappop(self.heap)
+        return due
+
+    def run(self, finish):
+        while not finish.is_set():
+            with self.cond:
+                due = self._pop_due(time.time())
+                if not due:
+                    wait = 1 if not self.heap else min(self.heap[0][0] - time.time(), 1)
+                    self.cond.wait(max(0, wait))
+                    continue
+            for callback in due:
+                callback()